@@ -0,0 +1,119 @@
+#include "kmer_index.hpp"
+
+#include <algorithm>
+#include <tuple>
+
+namespace xg {
+
+bool KmerIndex::encode(const string& kmer, uint64_t& key) {
+    if (kmer.size() > 32) return false;
+    key = 0;
+    for (auto c : kmer) {
+        key <<= 2;
+        switch (c) {
+        case 'A': case 'a': break;
+        case 'C': case 'c': key |= 1; break;
+        case 'G': case 'g': key |= 2; break;
+        case 'T': case 't': key |= 3; break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+void KmerIndex::pack_hits(vector<vector<hit_t> >& found, int_vector<64>& keys,
+                          int_vector<>& hit_starts, int_vector<>& hit_places,
+                          int_vector<>& hit_offsets) {
+    vector<hit_t> hits;
+    for (auto& f : found) {
+        hits.insert(hits.end(), f.begin(), f.end());
+        vector<hit_t>().swap(f);
+    }
+    std::sort(hits.begin(), hits.end());
+    hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+
+    size_t key_count = 0;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (i == 0 || get<0>(hits[i]) != get<0>(hits[i-1])) ++key_count;
+    }
+    util::assign(keys, int_vector<64>(key_count));
+    util::assign(hit_starts, int_vector<>(key_count + 1));
+    util::assign(hit_places, int_vector<>(hits.size()));
+    util::assign(hit_offsets, int_vector<>(hits.size()));
+    size_t key_off = 0;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (i == 0 || get<0>(hits[i]) != get<0>(hits[i-1])) {
+            keys[key_off] = get<0>(hits[i]);
+            hit_starts[key_off++] = i;
+        }
+        hit_places[i] = get<1>(hits[i]);
+        hit_offsets[i] = get<2>(hits[i]);
+    }
+    hit_starts[key_count] = hits.size();
+    util::bit_compress(hit_starts);
+    util::bit_compress(hit_places);
+    util::bit_compress(hit_offsets);
+}
+
+KmerIndex::KmerIndex(const XG& graph, size_t k, size_t branch_max) : kmer_size(k) {
+    if (k == 0 || k > 32) {
+        cerr << "[xg] error: k-mer size must be between 1 and 32" << endl;
+        exit(1);
+    }
+
+    // key, node id, offset*2 + is_reverse
+    vector<vector<hit_t> > found(omp_get_max_threads());
+    graph.for_each_kmer(k, [&](const string& kmer, const vector<pos_t>& positions) {
+            uint64_t key;
+            if (!encode(kmer, key)) return;
+            auto& start = positions.front();
+            found[omp_get_thread_num()].push_back(
+                make_tuple(key, pos_id(start), pos_offset(start) * 2 + pos_is_rev(start)));
+        }, branch_max);
+
+    pack_hits(found, keys, hit_starts, hit_ids, hit_offsets);
+}
+
+vector<KmerMatch> KmerIndex::find(const string& kmer) const {
+    vector<KmerMatch> matches;
+    uint64_t key;
+    if (kmer.size() != kmer_size || !encode(kmer, key)) return matches;
+    auto found = std::lower_bound(keys.begin(), keys.end(), key);
+    if (found == keys.end() || *found != key) return matches;
+    size_t i = found - keys.begin();
+    for (size_t j = hit_starts[i]; j < hit_starts[i+1]; ++j) {
+        KmerMatch match;
+        match.set_sequence(kmer);
+        match.set_node_id(hit_ids[j]);
+        match.set_position(hit_offsets[j] / 2);
+        match.set_backward(hit_offsets[j] % 2);
+        matches.push_back(match);
+    }
+    return matches;
+}
+
+void KmerIndex::load(istream& in) {
+    if (!in.good()) {
+        cerr << "[xg] error: k-mer index does not exist!" << endl;
+        exit(1);
+    }
+    sdsl::read_member(kmer_size, in);
+    keys.load(in);
+    hit_starts.load(in);
+    hit_ids.load(in);
+    hit_offsets.load(in);
+}
+
+size_t KmerIndex::serialize(ostream& out, sdsl::structure_tree_node* s, std::string name) const {
+    sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(s, name, sdsl::util::class_name(*this));
+    size_t written = 0;
+    written += sdsl::write_member(kmer_size, out, child, "kmer_size");
+    written += keys.serialize(out, child, "kmer_keys");
+    written += hit_starts.serialize(out, child, "kmer_hit_starts");
+    written += hit_ids.serialize(out, child, "kmer_hit_ids");
+    written += hit_offsets.serialize(out, child, "kmer_hit_offsets");
+    sdsl::structure_tree::add_size(child, written);
+    return written;
+}
+
+}
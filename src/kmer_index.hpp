@@ -0,0 +1,59 @@
+#ifndef XG_KMER_INDEX_HPP
+#define XG_KMER_INDEX_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include "xg.hpp"
+
+namespace xg {
+
+using namespace std;
+
+// Maps every k-mer of a graph, including those that cross edges, to the places
+// it starts. K-mers are packed 2 bits per base, so k can be at most 32, and
+// k-mers containing anything but ACGT are left out, as are those that take more
+// than branch_max branches (see XG::for_each_kmer).
+class KmerIndex {
+public:
+    KmerIndex(void) : kmer_size(0) { }
+    KmerIndex(const XG& graph, size_t k, size_t branch_max = XG::DEFAULT_BRANCH_MAX);
+
+    size_t k(void) const { return kmer_size; }
+    // Find everywhere the k-mer starts. Positions on the reverse strand count
+    // from the end of the node.
+    vector<KmerMatch> find(const string& kmer) const;
+
+    void load(istream& in);
+    size_t serialize(std::ostream& out,
+                     sdsl::structure_tree_node* v = NULL,
+                     std::string name = "") const;
+
+    // Pack a k-mer into a key. Returns false if it can't be packed.
+    static bool encode(const string& kmer, uint64_t& key);
+
+    // A hit as its key, where it is, and its offset*2 + is_reverse there.
+    typedef tuple<uint64_t, size_t, size_t> hit_t;
+    // Merge the hits found by each thread, drop duplicates, and pack them by
+    // key: the hits for keys[i] are at [hit_starts[i], hit_starts[i+1]) in
+    // hit_places and hit_offsets. The found lists are emptied.
+    static void pack_hits(vector<vector<hit_t> >& found, int_vector<64>& keys,
+                          int_vector<>& hit_starts, int_vector<>& hit_places,
+                          int_vector<>& hit_offsets);
+
+private:
+    size_t kmer_size;
+    // the distinct k-mers, sorted
+    int_vector<64> keys;
+    // the hits for keys[i] are at [hit_starts[i], hit_starts[i+1])
+    int_vector<> hit_starts;
+    // node id of each hit
+    int_vector<> hit_ids;
+    // offset along the strand * 2 + is_reverse for each hit
+    int_vector<> hit_offsets;
+};
+
+}
+
+#endif
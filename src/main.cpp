@@ -5,6 +5,9 @@
 #include "stream.hpp"
 #include "cpp/vg.pb.h"
 #include "xg.hpp"
+#include "server.hpp"
+#include "kmer_index.hpp"
+#include "minimizer_index.hpp"
 
 using namespace std;
 using namespace sdsl;
@@ -31,13 +34,38 @@ void help_main(char** argv) {
          << "    -S, --edges-on-start ID    list all edges on start of node with ID" << endl
          << "    -E, --edges-on-end ID      list all edges on start of node with ID" << endl
          << "    -p, --path TARGET    gets the region of the graph @ TARGET (chr:start-end)" << endl
+         << "    -q, --path-seq TARGET      print the sequence of the path @ TARGET (chr:start-end)" << endl
+         << "    -Z, --reverse-strand take the -q sequence from the reverse strand of the path" << endl
+         << "    -W, --fasta          write the sequence of every path as FASTA" << endl
+         << "    -w, --fasta-prefix P only write the paths whose names begin with P (implies -W)" << endl
+         << "    -B, --regions FILE   extract each region in the BED or chr:start-end list FILE" << endl
+         << "    -A, --path-dist ID,ID      minimum distance between two nodes along any path" << endl
+         << "    -X, --path-dist-pairs FILE distances as for -A for each ID pair per line of FILE" << endl
+         << "    -C, --node-positions index the path positions of each node for fast lookup" << endl
+         << "    -G, --seq-index      build an FM-index over the node sequences for -g" << endl
+         << "    -g, --find SEQ       list the node id, strand, and offset of each exact match to SEQ" << endl
+         << "    -K, --kmer-index FILE      k-mer index to build (with -k) or search (with -y)" << endl
+         << "    -k, --kmer-size N    index the k-mers of this length, crossing edges, into the -K FILE" << endl
+         << "    -y, --kmer SEQ       list the node id, strand, and offset of each start of k-mer SEQ" << endl
+         << "    -m, --minimizer-index FILE minimizer index to build (with -U and -k) or search (with -e)" << endl
+         << "    -U, --window N       index the minimizers of windows of N k-mers into the -m FILE" << endl
+         << "    -H, --max-branches N k-mers and minimizer windows take at most N branching edges (default " << XG::DEFAULT_BRANCH_MAX << ")" << endl
+         << "    -e, --seeds SEQ      list the minimizer hits of SEQ as read offset, node id, strand, offset" << endl
+         << "    -N, --node-records   store packed per-node records for faster traversal" << endl
+         << "    -M, --projections N  project nodes within N bp of each path onto it" << endl
          << "    -x, --extract-threads      extract succinct threads as paths" << endl
          << "    -r, --store-threads  store perfect match paths as succinct threads" << endl
          << "    -d, --is-sorted-dag  graph is a sorted dag; use fast thread insert" << endl
+         << "    -Y, --gpbwt MODE     keep threads in MODE: sdsl (static, fast) or dynamic (insertable)" << endl
+         << "    -a, --add-threads FILE     add the paths in vg FILE to the index as threads" << endl
+         << "    -L, --locality       rank nodes in topological order so neighbors are stored together" << endl
+         << "    -z, --tmp-dir DIR    write temporary files to DIR (default $TMPDIR, or /tmp)" << endl
          << "    -R, --report FILE    save an HTML space usage report to FILE when serializing" << endl
          << "    -D, --debug          show debugging output" << endl
          << "    -T, --text-output    write text instead of vg protobuf" << endl
          << "    -b, --dump-bs FILE   dump the gPBWT to the given file" << endl
+         << "    -j, --threads N      number of threads to use" << endl
+         << "    -Q, --serve SOCKET   answer queries on a Unix socket (- for stdin/stdout) until killed" << endl
          << "    -h, --help           this text" << endl;
 }
 
@@ -63,14 +91,38 @@ int main(int argc, char** argv) {
     int context_steps = 0;
     bool node_context = false;
     string target;
+    string regions_name;
+    string seq_target;
+    bool reverse_strand = false;
+    bool write_fasta = false;
+    string fasta_prefix;
+    int num_threads = 0;
+    string serve_name;
+    string path_dist_nodes;
+    string path_dist_pairs_name;
+    size_t projection_distance = 0;
+    bool index_node_positions = false;
+    bool index_sequence = false;
+    bool index_node_records = false;
+    string find_seq;
+    string kmer_index_name;
+    size_t kmer_size = 0;
+    string kmer_query;
+    string minimizer_index_name;
+    size_t window_size = 0;
+    size_t branch_max = XG::DEFAULT_BRANCH_MAX;
+    string seed_query;
     bool print_graph = false;
     bool text_output = false;
     bool validate_graph = false;
     bool extract_threads = false;
     bool store_threads = false;
     bool is_sorted_dag = false;
+    bool order_by_locality = false;
+    int gpbwt_mode = GPBWT_MODE;
     string report_name;
     string b_array_name;
+    string thread_vg_name;
     
     int c;
     optind = 1; // force optind past command positional argument
@@ -93,19 +145,44 @@ int main(int argc, char** argv) {
                 {"edges-on-end", required_argument, 0, 'E'},
                 {"node-seq", required_argument, 0, 's'},
                 {"path", required_argument, 0, 'p'},
+                {"regions", required_argument, 0, 'B'},
+                {"path-seq", required_argument, 0, 'q'},
+                {"reverse-strand", no_argument, 0, 'Z'},
+                {"fasta", no_argument, 0, 'W'},
+                {"fasta-prefix", required_argument, 0, 'w'},
+                {"path-dist", required_argument, 0, 'A'},
+                {"path-dist-pairs", required_argument, 0, 'X'},
+                {"projections", required_argument, 0, 'M'},
+                {"node-positions", no_argument, 0, 'C'},
+                {"seq-index", no_argument, 0, 'G'},
+                {"node-records", no_argument, 0, 'N'},
+                {"find", required_argument, 0, 'g'},
+                {"kmer-index", required_argument, 0, 'K'},
+                {"kmer-size", required_argument, 0, 'k'},
+                {"kmer", required_argument, 0, 'y'},
+                {"minimizer-index", required_argument, 0, 'm'},
+                {"window", required_argument, 0, 'U'},
+                {"seeds", required_argument, 0, 'e'},
                 {"extract-threads", no_argument, 0, 'x'},
                 {"store-threads", no_argument, 0, 'r'},
                 {"is-sorted-dag", no_argument, 0, 'd'},
+                {"locality", no_argument, 0, 'L'},
+                {"gpbwt", required_argument, 0, 'Y'},
+                {"add-threads", required_argument, 0, 'a'},
+                {"max-branches", required_argument, 0, 'H'},
+                {"tmp-dir", required_argument, 0, 'z'},
                 {"report", required_argument, 0, 'R'},
                 {"debug", no_argument, 0, 'D'},
                 {"text-output", no_argument, 0, 'T'},
                 {"validate", no_argument, 0, 'V'},
                 {"dump-bs", required_argument, 0, 'b'},
+                {"threads", required_argument, 0, 'j'},
+                {"serve", required_argument, 0, 'Q'},
                 {0, 0, 0, 0}
             };
 
         int option_index = 0;
-        c = getopt_long (argc, argv, "hv:o:i:f:t:s:c:n:p:DxrdTO:S:E:VR:P:F:b:",
+        c = getopt_long (argc, argv, "hv:o:i:f:t:s:c:n:p:DxrdTO:S:E:VR:P:F:b:B:j:Q:A:M:X:Cq:ZWw:Gg:K:k:y:m:U:e:LNY:a:H:z:",
                          long_options, &option_index);
 
         // Detect the end of the options.
@@ -143,6 +220,33 @@ int main(int argc, char** argv) {
             store_threads = true;
             break;
             
+        case 'L':
+            order_by_locality = true;
+            break;
+
+        case 'Y':
+            if (string(optarg) == "sdsl") {
+                gpbwt_mode = MODE_SDSL;
+            } else if (string(optarg) == "dynamic") {
+                gpbwt_mode = MODE_DYNAMIC;
+            } else {
+                cerr << "[xg] error: unknown gPBWT mode " << optarg << endl;
+                return 1;
+            }
+            break;
+
+        case 'a':
+            thread_vg_name = optarg;
+            break;
+
+        case 'H':
+            branch_max = atoi(optarg);
+            break;
+
+        case 'z':
+            set_temp_dir(optarg);
+            break;
+
         case 'd':
             is_sorted_dag = true;
             break;
@@ -194,6 +298,87 @@ int main(int argc, char** argv) {
             target = optarg;
             break;
 
+        case 'B':
+            regions_name = optarg;
+            break;
+
+        case 'q':
+            seq_target = optarg;
+            break;
+
+        case 'Z':
+            reverse_strand = true;
+            break;
+
+        case 'W':
+            write_fasta = true;
+            break;
+
+        case 'w':
+            write_fasta = true;
+            fasta_prefix = optarg;
+            break;
+
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+
+        case 'A':
+            path_dist_nodes = optarg;
+            break;
+
+        case 'X':
+            path_dist_pairs_name = optarg;
+            break;
+
+        case 'C':
+            index_node_positions = true;
+            break;
+
+        case 'G':
+            index_sequence = true;
+            break;
+
+        case 'N':
+            index_node_records = true;
+            break;
+
+        case 'g':
+            find_seq = optarg;
+            break;
+
+        case 'K':
+            kmer_index_name = optarg;
+            break;
+
+        case 'k':
+            kmer_size = atoi(optarg);
+            break;
+
+        case 'y':
+            kmer_query = optarg;
+            break;
+
+        case 'm':
+            minimizer_index_name = optarg;
+            break;
+
+        case 'U':
+            window_size = atoi(optarg);
+            break;
+
+        case 'e':
+            seed_query = optarg;
+            break;
+
+        case 'M':
+            projection_distance = atoi(optarg);
+            break;
+
+        case 'Q':
+            serve_name = optarg;
+            break;
+
         case 'P':
             pos_for_char = optarg;
             break;
@@ -221,17 +406,23 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (num_threads > 0) {
+        omp_set_num_threads(num_threads);
+    }
+
     XG* graph = nullptr;
     //string file_name = argv[optind];
     if (in_name.empty()) assert(!vg_name.empty());
     if (vg_name == "-") {
         graph = new XG;
-        graph->from_stream(std::cin, validate_graph, print_graph, store_threads, is_sorted_dag);
+        graph->from_stream(std::cin, validate_graph, print_graph, store_threads, is_sorted_dag,
+                           order_by_locality, gpbwt_mode);
     } else if (vg_name.size()) {
         ifstream in;
         in.open(vg_name.c_str());
         graph = new XG;
-        graph->from_stream(in, validate_graph, print_graph, store_threads, is_sorted_dag);
+        graph->from_stream(in, validate_graph, print_graph, store_threads, is_sorted_dag,
+                           order_by_locality, gpbwt_mode);
     }
 
     if (in_name.size()) {
@@ -245,6 +436,69 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (!thread_vg_name.empty()) {
+        // Gather each path across the chunks it comes in, and add the ones
+        // that are perfect matches, in mapping rank order, as build does.
+        map<string, vector<pair<int64_t, XG::ThreadMapping>>> paths;
+        set<string> imperfect;
+        vector<string> path_order;
+        ifstream in;
+        in.open(thread_vg_name.c_str());
+        if (!in.good()) {
+            cerr << "[xg] error: could not open " << thread_vg_name << endl;
+            return 1;
+        }
+        function<void(Graph&)> add_paths = [&](Graph& g) {
+            for (auto& path : g.path()) {
+                if (!paths.count(path.name())) path_order.push_back(path.name());
+                auto& steps = paths[path.name()];
+                for (auto& mapping : path.mapping()) {
+                    for (auto& edit : mapping.edit()) {
+                        if (edit.from_length() != edit.to_length() || !edit.sequence().empty()) {
+                            imperfect.insert(path.name());
+                        }
+                    }
+                    XG::ThreadMapping m = {mapping.position().node_id(), mapping.position().is_reverse()};
+                    steps.push_back(make_pair(mapping.rank(), m));
+                }
+            }
+        };
+        stream::for_each(in, add_paths);
+        vector<XG::thread_t> threads;
+        for (auto& name : path_order) {
+            if (imperfect.count(name)) {
+                cerr << "[xg] warning: path " << name << " is not a perfect match, so is not added as a thread" << endl;
+                continue;
+            }
+            auto& steps = paths[name];
+            std::stable_sort(steps.begin(), steps.end(),
+                             [](const pair<int64_t, XG::ThreadMapping>& a, const pair<int64_t, XG::ThreadMapping>& b) {
+                                 return a.first < b.first;
+                             });
+            XG::thread_t thread;
+            for (size_t i = 0; i < steps.size(); ++i) {
+                // Chunks can repeat a mapping at the edge of each, so drop repeats
+                if (i > 0 && steps[i].first && steps[i].first == steps[i - 1].first) continue;
+                thread.push_back(steps[i].second);
+            }
+            threads.push_back(thread);
+        }
+        graph->add_threads(threads);
+    }
+
+    if (index_node_records) {
+        graph->index_node_records();
+    }
+    if (index_node_positions) {
+        graph->index_node_positions();
+    }
+    if (index_sequence) {
+        graph->index_sequence_search();
+    }
+    if (projection_distance > 0) {
+        graph->index_path_projections(projection_distance);
+    }
+
     // Prepare structure tree for serialization
     unique_ptr<sdsl::structure_tree_node> structure;
     
@@ -286,6 +540,87 @@ int main(int argc, char** argv) {
         // then pick it up from the graph
         cout << graph->pos_char(id, is_rev, off) << endl;
     }
+    if (!find_seq.empty()) {
+        if (!graph->has_sequence_search()) {
+            cerr << "[xg] error: index has no sequence FM-index, build one with -G" << endl;
+            exit(1);
+        }
+        for (auto& pos : graph->find_sequence(find_seq)) {
+            cout << pos_id(pos) << "\t" << (pos_is_rev(pos) ? "-" : "+") << "\t" << pos_offset(pos) << endl;
+        }
+    }
+    if (!kmer_query.empty() && kmer_index_name.empty()) {
+        cerr << "[xg] error: k-mer search needs a k-mer index file (-K)" << endl;
+        exit(1);
+    }
+    if (!kmer_index_name.empty()) {
+        KmerIndex kmers;
+        if (kmer_size > 0) {
+            kmers = KmerIndex(*graph, kmer_size, branch_max);
+            ofstream out(kmer_index_name.c_str());
+            kmers.serialize(out);
+        } else {
+            ifstream in(kmer_index_name.c_str());
+            kmers.load(in);
+        }
+        if (!kmer_query.empty()) {
+            for (auto& match : kmers.find(kmer_query)) {
+                cout << match.node_id() << "\t" << (match.backward() ? "-" : "+") << "\t" << match.position() << endl;
+            }
+        }
+    }
+    if (!seed_query.empty() && minimizer_index_name.empty()) {
+        cerr << "[xg] error: seed search needs a minimizer index file (-m)" << endl;
+        exit(1);
+    }
+    if (!minimizer_index_name.empty()) {
+        MinimizerIndex minimizers;
+        if (window_size > 0) {
+            minimizers = MinimizerIndex(*graph, kmer_size, window_size, branch_max);
+            ofstream out(minimizer_index_name.c_str());
+            minimizers.serialize(out);
+        } else {
+            ifstream in(minimizer_index_name.c_str());
+            minimizers.load(in);
+        }
+        if (!seed_query.empty()) {
+            for (auto& seed : minimizers.query(*graph, seed_query)) {
+                auto& pos = seed.second;
+                cout << seed.first << "\t" << pos_id(pos) << "\t" << (pos_is_rev(pos) ? "-" : "+")
+                     << "\t" << pos_offset(pos) << endl;
+            }
+        }
+    }
+    if (!path_dist_nodes.empty()) {
+        size_t comma = path_dist_nodes.find(',');
+        if (comma == string::npos) {
+            cerr << "[xg] error: path distance needs two node ids, as ID,ID" << endl;
+            exit(1);
+        }
+        int64_t id1 = stol(path_dist_nodes.substr(0, comma));
+        int64_t id2 = stol(path_dist_nodes.substr(comma+1));
+        cout << graph->min_approx_path_distance(vector<string>(), id1, id2) << endl;
+    }
+    if (!path_dist_pairs_name.empty()) {
+        ifstream pairs_file;
+        if (path_dist_pairs_name != "-") {
+            pairs_file.open(path_dist_pairs_name.c_str());
+            if (!pairs_file.good()) {
+                cerr << "[xg] error: could not open " << path_dist_pairs_name << endl;
+                exit(1);
+            }
+        }
+        istream& in = path_dist_pairs_name == "-" ? std::cin : pairs_file;
+        vector<pair<int64_t, int64_t> > pairs;
+        int64_t id1, id2;
+        while (in >> id1 >> id2) {
+            pairs.push_back(make_pair(id1, id2));
+        }
+        for (auto dist : graph->min_path_distances(pairs)) {
+            cout << dist << "\n";
+        }
+        cout.flush();
+    }
     if (!pos_for_substr.empty()) {
         int64_t id;
         bool is_rev;
@@ -357,14 +692,126 @@ int main(int argc, char** argv) {
         }
     }
     
+    if (!seq_target.empty()) {
+        string name;
+        int64_t start, end;
+        parse_region(seq_target, name, start, end);
+        if (graph->path_rank(name) == 0) {
+            cerr << "[xg] error: no path named " << name << endl;
+            exit(1);
+        }
+        cout << graph->path_substr(name, start, end, reverse_strand) << endl;
+    }
+
+    if (write_fasta) {
+        graph->write_path_fasta(cout, fasta_prefix);
+    }
+
+    if (!regions_name.empty()) {
+        ifstream regions_file;
+        if (regions_name != "-") {
+            regions_file.open(regions_name.c_str());
+            if (!regions_file.good()) {
+                cerr << "[xg] error: could not open regions file " << regions_name << endl;
+                exit(1);
+            }
+        }
+        istream& regions_in = regions_name == "-" ? std::cin : regions_file;
+        // Regions are extracted in parallel as they are read. Each result goes
+        // into a reorder buffer by its number, and whichever worker fills the
+        // next gap writes out everything that is ready from there, so the
+        // output keeps input order without holding workers at a barrier. After
+        // each window of regions the reader waits for them, running queued
+        // ones itself, so it gets through even with a single thread.
+        size_t window = omp_get_max_threads() * 64;
+        map<size_t, pair<string, Graph> > ready;
+        size_t next_to_write = 0;
+        size_t region_count = 0;
+        string bad_line;
+#pragma omp parallel
+#pragma omp single
+        {
+            string line;
+            size_t line_number = 0;
+            while (getline(regions_in, line)) {
+                ++line_number;
+                if (line.empty() || line[0] == '#'
+                    || line.compare(0, 5, "track") == 0
+                    || line.compare(0, 7, "browser") == 0) {
+                    continue;
+                }
+                string region;
+                size_t tab = line.find('\t');
+                if (tab == string::npos) {
+                    // already a chr:start-end region
+                    region = line;
+                } else {
+                    // BED is 0-based and end-exclusive, regions are end-inclusive
+                    size_t tab2 = line.find('\t', tab + 1);
+                    string start_field = line.substr(tab + 1, tab2 == string::npos ? string::npos : tab2 - tab - 1);
+                    string end_field = tab2 == string::npos ? "" : line.substr(tab2 + 1, line.find('\t', tab2 + 1) - tab2 - 1);
+                    char* start_rest;
+                    char* end_rest;
+                    int64_t start = strtoll(start_field.c_str(), &start_rest, 10);
+                    int64_t end = strtoll(end_field.c_str(), &end_rest, 10);
+                    if (start_field.empty() || end_field.empty() || *start_rest || *end_rest || start < 0 || end <= start) {
+                        // Stop reading, and report once the regions already
+                        // started are written.
+                        bad_line = "line " + to_string(line_number) + " of " + regions_name
+                            + " is not a BED region with chrom, start and end: " + line;
+                        break;
+                    }
+                    region = line.substr(0, tab) + ":" + to_string(start) + "-" + to_string(end - 1);
+                }
+                size_t number = region_count++;
+#pragma omp task firstprivate(region, number)
+                {
+                    string name;
+                    int64_t start, end;
+                    parse_region(region, name, start, end);
+                    Graph g;
+                    graph->get_path_range(name, start, end, g);
+                    graph->expand_context(g, context_steps);
+                    // tag the chunk with the region it came from
+                    g.add_path()->set_name(region);
+#pragma omp critical (regions_out)
+                    {
+                        auto& slot = ready[number];
+                        slot.first = region;
+                        slot.second.Swap(&g);
+                        while (!ready.empty() && ready.begin()->first == next_to_write) {
+                            auto& done = ready.begin()->second;
+                            if (text_output) {
+                                cout << "#" << "\t" << done.first << endl;
+                                to_text(cout, done.second);
+                            } else {
+                                vector<Graph> gb = { done.second };
+                                stream::write_buffered(cout, gb, 0);
+                            }
+                            ready.erase(ready.begin());
+#pragma omp atomic update
+                            ++next_to_write;
+                        }
+                    }
+                }
+                if (region_count % window == 0) {
+#pragma omp taskwait
+                }
+            }
+        }
+        if (!bad_line.empty()) {
+            cerr << "[xg] error: " << bad_line << endl;
+            return 1;
+        }
+    }
+
     if (extract_threads) {
-        
-    
-        size_t thread_number = 0;
-        for(XG::thread_t& thread : graph->extract_threads()) {
+        // Threads are written out as they are found, so the order varies, but
+        // each keeps the name it gets from its place in the index.
+        graph->for_each_thread([&](size_t thread_number, const XG::thread_t& thread) {
             // Convert to a Path
             Path path;
-            for(XG::ThreadMapping& m : thread) {
+            for(const XG::ThreadMapping& m : thread) {
                 // Convert all the mappings
                 Mapping mapping;
                 mapping.mutable_position()->set_node_id(m.node_id);
@@ -375,7 +822,7 @@ int main(int argc, char** argv) {
         
         
             // Give each thread a name
-            path.set_name("_thread_" + to_string(thread_number++));
+            path.set_name("_thread_" + to_string(thread_number));
             
             // We need a Graph for serialization purposes. We do one chunk per
             // thread in case the threads are long.
@@ -386,14 +833,17 @@ int main(int argc, char** argv) {
             // Dump the graph with its mappings. TODO: can we restrict these to
             // mappings to nodes we have already pulled out? Or pull out the
             // whole compressed graph?
-            if (text_output) {
-                to_text(cout, g);
-            } else {
-                vector<Graph> gb = { g };
-                stream::write_buffered(cout, gb, 0);
+#pragma omp critical (cout)
+            {
+                if (text_output) {
+                    to_text(cout, g);
+                } else {
+                    vector<Graph> gb = { g };
+                    stream::write_buffered(cout, gb, 0);
+                }
             }
             
-        }
+        });
     }
 
     if (!b_array_name.empty()) {
@@ -403,6 +853,24 @@ int main(int argc, char** argv) {
         graph->bs_dump(out);
     }
 
+    if (!serve_name.empty()) {
+        // the handle owns the index from here on, so it can be swapped out
+        XGHandle handle(shared_ptr<const XG>(graph));
+        graph = nullptr;
+        // clients may reload indexes that sit next to the one we started with
+        string reload_dir = ".";
+        if (in_name.size() && in_name != "-" && in_name.rfind('/') != string::npos) {
+            reload_dir = in_name.substr(0, in_name.rfind('/'));
+            if (reload_dir.empty()) reload_dir = "/";
+        }
+        XGServer server(handle, omp_get_max_threads(), text_output, reload_dir);
+        if (serve_name == "-") {
+            server.serve(std::cin, std::cout);
+        } else {
+            server.serve_socket(serve_name);
+        }
+    }
+
     // clean up
     if (graph) delete graph;
 
@@ -0,0 +1,216 @@
+#include "minimizer_index.hpp"
+#include "kmer_index.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <tuple>
+
+namespace xg {
+
+uint64_t MinimizerIndex::hash(uint64_t key) {
+    // Thomas Wang's 64-bit mix, so that poly-A doesn't win every window
+    key = (~key) + (key << 21);
+    key = key ^ (key >> 24);
+    key = (key + (key << 3)) + (key << 8);
+    key = key ^ (key >> 14);
+    key = (key + (key << 2)) + (key << 4);
+    key = key ^ (key >> 28);
+    key = key + (key << 31);
+    return key;
+}
+
+// The minimizer windows over a stream of bases, fed one base at a time. Each
+// k-mer is packed and hashed once as its last base goes in, and the window's
+// candidates are kept with hashes rising from the front; a k-mer only
+// displaces strictly bigger ones, so the leftmost of equal hashes stays in
+// front and wins the window. Copying one is cheap, so a walk can branch.
+struct MinimizerWindow {
+    struct candidate_t {
+        size_t index;
+        uint64_t hash;
+        uint64_t key;
+        pos_t pos;
+    };
+
+    size_t k;
+    size_t w;
+    uint64_t mask;
+    uint64_t key = 0;
+    size_t run = 0; // bases since the last one we can't pack
+    size_t fed = 0;
+    // where the last k bases came from, by base index mod k
+    vector<pos_t> recent;
+    deque<candidate_t> candidates;
+    size_t last_reported = numeric_limits<size_t>::max();
+
+    MinimizerWindow(size_t k, size_t w) : k(k), w(w), recent(k) {
+        mask = k == 32 ? ~(uint64_t)0 : ((uint64_t)1 << (2 * k)) - 1;
+    }
+
+    // Take the next base, from pos, and call report with the k-mer index,
+    // key and position of the window's minimizer if this completes a window
+    // with a new one.
+    template<typename Report>
+    void feed(char c, const pos_t& pos, const Report& report) {
+        size_t i = fed++;
+        recent[i % k] = pos;
+        uint64_t base;
+        switch (c) {
+        case 'A': case 'a': base = 0; break;
+        case 'C': case 'c': base = 1; break;
+        case 'G': case 'g': base = 2; break;
+        case 'T': case 't': base = 3; break;
+        default: base = 4; break;
+        }
+        if (base < 4) {
+            key = ((key << 2) | base) & mask;
+            ++run;
+        } else {
+            run = 0;
+        }
+        if (i + 1 < k) return;
+        size_t kmer = i + 1 - k;
+        if (run >= k) {
+            uint64_t h = MinimizerIndex::hash(key);
+            while (!candidates.empty() && candidates.back().hash > h) {
+                candidates.pop_back();
+            }
+            candidates.push_back({kmer, h, key, recent[kmer % k]});
+        }
+        if (kmer + 1 < w) return;
+        size_t start = kmer + 1 - w;
+        while (!candidates.empty() && candidates.front().index < start) {
+            candidates.pop_front();
+        }
+        if (candidates.empty() || candidates.front().index == last_reported) return;
+        auto& best = candidates.front();
+        last_reported = best.index;
+        report(best.index, best.key, best.pos);
+    }
+};
+
+vector<pair<size_t, uint64_t> > MinimizerIndex::minimizers(const string& sequence, size_t k, size_t w) {
+    vector<pair<size_t, uint64_t> > found;
+    if (k == 0 || w == 0 || sequence.size() < w + k - 1) return found;
+    MinimizerWindow window(k, w);
+    for (size_t i = 0; i < sequence.size(); ++i) {
+        window.feed(sequence[i], make_pos(0, false, i), [&](size_t index, uint64_t key, const pos_t& pos) {
+                found.push_back(make_pair(index, key));
+            });
+    }
+    return found;
+}
+
+MinimizerIndex::MinimizerIndex(const XG& graph, size_t k, size_t w, size_t branch_max) : kmer_size(k), window_size(w) {
+    if (k == 0 || k > 32) {
+        cerr << "[xg] error: minimizer k-mer size must be between 1 and 32" << endl;
+        exit(1);
+    }
+    if (w == 0) {
+        cerr << "[xg] error: minimizer windows must hold at least one k-mer" << endl;
+        exit(1);
+    }
+
+    // key, node rank, offset*2 + is_reverse
+    vector<vector<KmerIndex::hit_t> > found(omp_get_max_threads());
+    // Each window is a walk of w+k-1 bases. We stream each node strand once
+    // for the windows that start on it, and then carry the same window on
+    // along each walk out of it, copying it only where the walk branches, so
+    // every k-mer on a walk is hashed once. As with for_each_kmer, windows
+    // that take more than branch_max branches are left out.
+    size_t span = w + k - 1;
+    size_t node_ranks = graph.max_node_rank();
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t rank = 1; rank <= node_ranks; ++rank) {
+        auto& hits = found[omp_get_thread_num()];
+        auto report = [&](size_t index, uint64_t key, const pos_t& pos) {
+            hits.push_back(make_tuple(key, graph.id_to_rank(pos_id(pos)),
+                                      pos_offset(pos) * 2 + pos_is_rev(pos)));
+        };
+        for (bool is_rev : { false, true }) {
+            string seq = graph.strand_sequence(rank, is_rev);
+            // the last window starting on this strand ends this many bases in
+            size_t limit = seq.size() + span - 1;
+            function<void(MinimizerWindow&, size_t, bool, size_t)> extend =
+                [&](MinimizerWindow& window, size_t from_rank, bool from_rev, size_t branches) {
+                // we leave a forward node by its end, a reverse one by its start
+                vector<pair<size_t, bool> > next;
+                graph.for_each_edge_on_side(from_rank, !from_rev, [&](size_t next_rank, bool enters_end) {
+                        next.push_back(make_pair(next_rank, enters_end));
+                    });
+                if (next.size() > 1) ++branches;
+                if (next.empty() || branches > branch_max) return;
+                auto walk_on = [&](MinimizerWindow& walk, const pair<size_t, bool>& step) {
+                    // coming in at the end means reading the node backward
+                    string next_seq = graph.strand_sequence(step.first, step.second);
+                    int64_t next_id = graph.rank_to_id(step.first);
+                    for (size_t i = 0; i < next_seq.size() && walk.fed < limit; ++i) {
+                        walk.feed(next_seq[i], make_pos(next_id, step.second, i), report);
+                    }
+                    if (walk.fed < limit) extend(walk, step.first, step.second, branches);
+                };
+                // every step but the last gets its own copy of the window, and
+                // the last takes this one on
+                for (size_t j = 0; j + 1 < next.size(); ++j) {
+                    MinimizerWindow branch = window;
+                    walk_on(branch, next[j]);
+                }
+                walk_on(window, next.back());
+            };
+            MinimizerWindow window(k, w);
+            int64_t id = graph.rank_to_id(rank);
+            for (size_t i = 0; i < seq.size(); ++i) {
+                window.feed(seq[i], make_pos(id, is_rev, i), report);
+            }
+            if (window.fed < limit) extend(window, rank, is_rev, 0);
+        }
+    }
+
+    // overlapping windows and different walks find the same minimizers
+    KmerIndex::pack_hits(found, keys, hit_starts, hit_ranks, hit_offsets);
+}
+
+vector<pair<size_t, pos_t> > MinimizerIndex::query(const XG& graph, const string& sequence) const {
+    vector<pair<size_t, pos_t> > seeds;
+    for (auto& minimizer : minimizers(sequence, kmer_size, window_size)) {
+        auto found = std::lower_bound(keys.begin(), keys.end(), minimizer.second);
+        if (found == keys.end() || *found != minimizer.second) continue;
+        size_t i = found - keys.begin();
+        for (size_t j = hit_starts[i]; j < hit_starts[i+1]; ++j) {
+            seeds.push_back(make_pair(minimizer.first,
+                                      make_pos(graph.rank_to_id(hit_ranks[j]),
+                                               hit_offsets[j] % 2, hit_offsets[j] / 2)));
+        }
+    }
+    return seeds;
+}
+
+void MinimizerIndex::load(istream& in) {
+    if (!in.good()) {
+        cerr << "[xg] error: minimizer index does not exist!" << endl;
+        exit(1);
+    }
+    sdsl::read_member(kmer_size, in);
+    sdsl::read_member(window_size, in);
+    keys.load(in);
+    hit_starts.load(in);
+    hit_ranks.load(in);
+    hit_offsets.load(in);
+}
+
+size_t MinimizerIndex::serialize(ostream& out, sdsl::structure_tree_node* s, std::string name) const {
+    sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(s, name, sdsl::util::class_name(*this));
+    size_t written = 0;
+    written += sdsl::write_member(kmer_size, out, child, "kmer_size");
+    written += sdsl::write_member(window_size, out, child, "window_size");
+    written += keys.serialize(out, child, "minimizer_keys");
+    written += hit_starts.serialize(out, child, "minimizer_hit_starts");
+    written += hit_ranks.serialize(out, child, "minimizer_hit_ranks");
+    written += hit_offsets.serialize(out, child, "minimizer_hit_offsets");
+    sdsl::structure_tree::add_size(child, written);
+    return written;
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef XG_MINIMIZER_INDEX_HPP
+#define XG_MINIMIZER_INDEX_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "xg.hpp"
+
+namespace xg {
+
+using namespace std;
+
+// Indexes the (w,k)-minimizers of every walk through a graph: in each window of
+// w consecutive k-mers, the one with the smallest hash. Windows run across edges
+// just as k-mers do, and a minimizer reached through several walks is stored
+// once. K-mers are packed 2 bits per base, so k can be at most 32. Windows that
+// take more than branch_max branches are left out.
+class MinimizerIndex {
+public:
+    MinimizerIndex(void) : kmer_size(0), window_size(0) { }
+    MinimizerIndex(const XG& graph, size_t k, size_t w, size_t branch_max = XG::DEFAULT_BRANCH_MAX);
+
+    size_t k(void) const { return kmer_size; }
+    size_t w(void) const { return window_size; }
+    // Find the minimizers of a sequence and return each of their hits in the
+    // graph, as the offset of the minimizer in the sequence and the position
+    // of its first base in the graph.
+    vector<pair<size_t, pos_t> > query(const XG& graph, const string& sequence) const;
+
+    void load(istream& in);
+    size_t serialize(std::ostream& out,
+                     sdsl::structure_tree_node* v = NULL,
+                     std::string name = "") const;
+
+    // Hash a packed k-mer to order minimizers.
+    static uint64_t hash(uint64_t key);
+    // Find the minimizer of each window of the sequence, as the offset of the
+    // k-mer in the sequence and its packed key. A minimizer shared by
+    // neighboring windows is listed once.
+    static vector<pair<size_t, uint64_t> > minimizers(const string& sequence, size_t k, size_t w);
+
+private:
+    size_t kmer_size;
+    size_t window_size;
+    // the distinct minimizer k-mers, sorted
+    int_vector<64> keys;
+    // the hits for keys[i] are at [hit_starts[i], hit_starts[i+1])
+    int_vector<> hit_starts;
+    // node rank of each hit
+    int_vector<> hit_ranks;
+    // offset along the strand * 2 + is_reverse for each hit
+    int_vector<> hit_offsets;
+};
+
+}
+
+#endif
@@ -0,0 +1,296 @@
+#include "server.hpp"
+#include "stream.hpp"
+
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace xg {
+
+XGServer::XGServer(XGHandle& handle, size_t threads, bool text_output,
+                   const string& reload_dir)
+    : handle(handle),
+      threads(max((size_t)1, threads)),
+      text_output(text_output),
+      reload_dir(reload_dir) { }
+
+// Put the header on a response so the client knows how much to read.
+static string frame_response(bool ok, const string& payload) {
+    return string(ok ? "OK " : "ERR ") + to_string(payload.size()) + "\n" + payload;
+}
+
+static bool write_all(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+bool XGServer::answer(const string& request, string& response) const {
+    stringstream args(request);
+    stringstream out;
+    string command;
+    args >> command;
+
+    // hold on to this index until we're done, even if it's replaced meanwhile
+    shared_ptr<const XG> held = handle.get();
+    const XG& index = *held;
+
+    auto fail = [&](const string& message) {
+        response = message + "\n";
+        return false;
+    };
+    auto read_node = [&](int64_t& id) {
+        return (bool)(args >> id) && index.has_node(id);
+    };
+    auto write_edges = [&](const vector<Edge>& edges) {
+        for (auto& edge : edges) {
+            out << edge.from() << (edge.from_start()?"-":"+")
+                << " -> " << edge.to() << (edge.to_end()?"-":"+") << endl;
+        }
+    };
+    auto write_graph = [&](Graph& g) {
+        if (text_output) {
+            to_text(out, g);
+        } else {
+            vector<Graph> gb = { g };
+            stream::write_buffered(out, gb, 0);
+        }
+    };
+
+    try {
+        int64_t id;
+        if (command == "node-seq") {
+            if (!read_node(id)) return fail("no such node");
+            out << index.node_sequence(id) << endl;
+        } else if (command == "edges-from") {
+            if (!read_node(id)) return fail("no such node");
+            write_edges(index.edges_from(id));
+        } else if (command == "edges-to") {
+            if (!read_node(id)) return fail("no such node");
+            write_edges(index.edges_to(id));
+        } else if (command == "edges-of") {
+            if (!read_node(id)) return fail("no such node");
+            write_edges(index.edges_of(id));
+        } else if (command == "edges-on-start") {
+            if (!read_node(id)) return fail("no such node");
+            write_edges(index.edges_on_start(id));
+        } else if (command == "edges-on-end") {
+            if (!read_node(id)) return fail("no such node");
+            write_edges(index.edges_on_end(id));
+        } else if (command == "neighborhood") {
+            if (!read_node(id)) return fail("no such node");
+            size_t steps;
+            if (!(args >> steps)) steps = 1;
+            Graph g;
+            index.neighborhood(id, steps, g);
+            write_graph(g);
+        } else if (command == "path-range") {
+            string target;
+            args >> target;
+            size_t steps;
+            if (!(args >> steps)) steps = 0;
+            string name;
+            int64_t start, end;
+            parse_region(target, name, start, end);
+            if (index.path_rank(name) == 0) return fail("no such path");
+            Graph g;
+            index.get_path_range(name, start, end, g);
+            index.expand_context(g, steps);
+            write_graph(g);
+        } else if (command == "pos-char" || command == "substr") {
+            string pos;
+            args >> pos;
+            size_t colons = std::count(pos.begin(), pos.end(), ':');
+            if (colons != (command == "pos-char" ? 1 : 2)) {
+                return fail("positions look like ID:OFF, substrings like ID:OFF:LEN");
+            }
+            bool is_rev;
+            size_t off;
+            size_t len = 0;
+            if (command == "pos-char") {
+                extract_pos(pos, id, is_rev, off);
+            } else {
+                extract_pos_substr(pos, id, is_rev, off, len);
+            }
+            if (!index.has_node(id)) return fail("no such node");
+            if (off >= index.node_length(id)) return fail("offset past end of node");
+            if (command == "pos-char") {
+                out << index.pos_char(id, is_rev, off) << endl;
+            } else {
+                out << index.pos_substr(id, is_rev, off, len) << endl;
+            }
+        } else if (command == "node-at-position") {
+            string name;
+            size_t pos;
+            if (!(args >> name >> pos)) return fail("usage: node-at-position PATH POS");
+            if (index.path_rank(name) == 0) return fail("no such path");
+            if (pos >= index.path_length(name)) return fail("position past end of path");
+            Mapping m = index.mapping_at_path_position(name, pos);
+            out << m.position().node_id() << (m.position().is_reverse() ? "-" : "+") << endl;
+        } else if (command == "node-positions") {
+            if (!read_node(id)) return fail("no such node");
+            for (auto& p : index.node_positions_in_paths(id)) {
+                out << p.first;
+                for (size_t i = 0; i < p.second.size(); ++i) {
+                    out << (i ? "," : "\t") << p.second[i];
+                }
+                out << endl;
+            }
+        } else if (command == "path-distance") {
+            int64_t id2;
+            if (!read_node(id) || !(args >> id2) || !index.has_node(id2)) return fail("no such node");
+            out << index.min_approx_path_distance(vector<string>(), id, id2) << endl;
+        } else if (command == "count-threads") {
+            XG::thread_t thread;
+            string step;
+            while (args >> step) {
+                char strand = step.back();
+                if (strand != '+' && strand != '-') return fail("thread steps look like ID+ or ID-");
+                int64_t step_id = stol(step.substr(0, step.size() - 1));
+                if (!index.has_node(step_id)) return fail("no such node");
+                thread.push_back({step_id, strand == '-'});
+            }
+            out << index.count_matches(thread) << endl;
+        } else if (command == "reload") {
+            string filename;
+            if (!(args >> filename)) return fail("usage: reload FILE");
+            if (filename.find('/') != string::npos || filename == "." || filename == "..") {
+                return fail("reload takes a file name in " + reload_dir);
+            }
+            string error;
+            if (!handle.reload(reload_dir + "/" + filename, error)) return fail(error);
+            out << "reloaded " << filename << endl;
+        } else {
+            return fail("unknown command: " + command);
+        }
+    } catch (const exception& e) {
+        return fail(string("bad request: ") + e.what());
+    }
+
+    response = out.str();
+    return true;
+}
+
+void XGServer::serve(istream& in, ostream& out) const {
+    string line;
+    while (getline(in, line)) {
+        if (line == "quit") break;
+        if (line.empty()) continue;
+        string response;
+        bool ok = answer(line, response);
+        out << frame_response(ok, response);
+        out.flush();
+    }
+}
+
+void XGServer::serve_connection(int fd) const {
+    string buffer;
+    char chunk[4096];
+    while (true) {
+        size_t newline;
+        while ((newline = buffer.find('\n')) != string::npos) {
+            string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line == "quit") return;
+            if (line.empty()) continue;
+            string response;
+            bool ok = answer(line, response);
+            if (!write_all(fd, frame_response(ok, response))) return;
+        }
+        ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return;
+        buffer.append(chunk, got);
+    }
+}
+
+void XGServer::serve_socket(const string& socket_path) const {
+    // a client hanging up mid-response shouldn't take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        cerr << "[xg] error: socket path " << socket_path << " is too long" << endl;
+        exit(1);
+    }
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listener < 0
+        || ::bind(listener, (sockaddr*)&address, sizeof(address)) < 0
+        || ::listen(listener, 64) < 0) {
+        cerr << "[xg] error: could not listen on " << socket_path << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+
+    // connections wait here for a free worker
+    queue<int> connections;
+    mutex connections_mutex;
+    condition_variable connection_ready;
+    bool stopping = false;
+
+    vector<thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&](void) {
+            while (true) {
+                int fd;
+                {
+                    unique_lock<mutex> lock(connections_mutex);
+                    connection_ready.wait(lock, [&](void) { return stopping || !connections.empty(); });
+                    if (connections.empty()) return;
+                    fd = connections.front();
+                    connections.pop();
+                }
+                serve_connection(fd);
+                close(fd);
+            }
+        });
+    }
+
+    while (true) {
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            cerr << "[xg] error: accept failed: " << strerror(errno) << endl;
+            break;
+        }
+        {
+            lock_guard<mutex> lock(connections_mutex);
+            connections.push(fd);
+        }
+        connection_ready.notify_one();
+    }
+
+    {
+        lock_guard<mutex> lock(connections_mutex);
+        stopping = true;
+    }
+    connection_ready.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    close(listener);
+    unlink(socket_path.c_str());
+}
+
+}
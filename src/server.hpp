@@ -0,0 +1,63 @@
+#ifndef XG_SERVER_HPP
+#define XG_SERVER_HPP
+
+#include <iostream>
+#include <string>
+#include "xg.hpp"
+
+namespace xg {
+
+using namespace std;
+
+// Answers a stream of queries against an index that is loaded only once.
+//
+// Each request is a single line holding a command and its arguments:
+//
+//     node-seq ID
+//     edges-from ID, edges-to ID, edges-of ID, edges-on-start ID, edges-on-end ID
+//     neighborhood ID [STEPS]
+//     path-range TARGET [STEPS]     (TARGET is chr:start-end)
+//     pos-char ID:OFF               (ID:-OFF for the reverse strand)
+//     substr ID:OFF:LEN
+//     node-at-position PATH POS
+//     node-positions ID
+//     path-distance ID ID
+//     count-threads ID+ ID- ...
+//     reload FILE                   (swap in the index FILE from the reload directory)
+//     quit
+//
+// Each response is a header line, "OK <bytes>" or "ERR <bytes>", followed by
+// exactly that many bytes of payload. Graphs are sent as vg protobuf unless
+// text output was requested.
+//
+// Each request runs against whatever index was current when it arrived, so a
+// reload never disturbs requests already in flight. Clients can only reload
+// plain file names in the reload directory, and a file that isn't a whole
+// index is refused without touching the current one.
+class XGServer {
+public:
+    XGServer(XGHandle& handle, size_t threads = 1, bool text_output = false,
+             const string& reload_dir = ".");
+
+    // Answer the requests read from in on out, in order, until in runs dry or
+    // we are asked to quit.
+    void serve(istream& in, ostream& out) const;
+    // Listen on a Unix domain socket at the given path, handing connections
+    // out to a pool of worker threads. Each connection is answered in order.
+    void serve_socket(const string& socket_path) const;
+    // Answer one request line. Returns false, with an error message as the
+    // response, if the request could not be answered.
+    bool answer(const string& request, string& response) const;
+
+private:
+    void serve_connection(int fd) const;
+
+    XGHandle& handle;
+    size_t threads;
+    bool text_output;
+    string reload_dir;
+};
+
+}
+
+#endif
@@ -1,7 +1,10 @@
 #include "xg.hpp"
 #include "stream.hpp"
+#include "dynamic.hpp"
 
 #include <bitset>
+#include <queue>
+#include <numeric>
 
 namespace xg {
 
@@ -33,6 +36,22 @@ trav_t make_trav(id_t id, bool is_rev, int32_t rank) {
     return make_pair(!is_rev ? id : -1 * id, rank);
 }
 
+id_t pos_id(const pos_t& pos) {
+    return get<0>(pos);
+}
+
+bool pos_is_rev(const pos_t& pos) {
+    return get<1>(pos);
+}
+
+size_t pos_offset(const pos_t& pos) {
+    return get<2>(pos);
+}
+
+pos_t make_pos(id_t id, bool is_rev, size_t offset) {
+    return make_tuple(id, is_rev, offset);
+}
+
 int dna3bit(char c) {
     switch (c) {
     case 'A':
@@ -63,8 +82,15 @@ char revdna3bit(int i) {
     }
 }
 
-const XG::destination_t XG::BS_SEPARATOR = 1;
-const XG::destination_t XG::BS_NULL = 0;
+const size_t BsStore::NULL_DESTINATION;
+const size_t BsStore::SEPARATOR;
+
+const XG::destination_t XG::BS_SEPARATOR = BsStore::SEPARATOR;
+const XG::destination_t XG::BS_NULL = BsStore::NULL_DESTINATION;
+
+const size_t XG::DEFAULT_BRANCH_MAX;
+const uint32_t XG::FILE_MAGIC;
+const uint32_t XG::FILE_VERSION;
 
 XG::XG(istream& in)
     : start_marker('#'),
@@ -104,12 +130,156 @@ XG::~XG(void) {
     }
 }
 
-void XG::load(istream& in) {
+XG::XG(XG&& other) : XG() {
+    swap(other);
+}
+
+XG& XG::operator=(XG&& other) {
+    swap(other);
+    return *this;
+}
+
+void XG::swap(XG& other) {
+    if (this == &other) return;
+    
+    std::swap(start_marker, other.start_marker);
+    std::swap(end_marker, other.end_marker);
+    std::swap(seq_length, other.seq_length);
+    std::swap(node_count, other.node_count);
+    std::swap(edge_count, other.edge_count);
+    std::swap(path_count, other.path_count);
+    std::swap(min_id, other.min_id);
+    std::swap(max_id, other.max_id);
+    
+    s_iv.swap(other.s_iv);
+    s_bv.swap(other.s_bv);
+    util::swap_support(s_bv_rank, other.s_bv_rank, &s_bv, &other.s_bv);
+    util::swap_support(s_bv_select, other.s_bv_select, &s_bv, &other.s_bv);
+    s_cbv.swap(other.s_cbv);
+    util::swap_support(s_cbv_rank, other.s_cbv_rank, &s_cbv, &other.s_cbv);
+    util::swap_support(s_cbv_select, other.s_cbv_select, &s_cbv, &other.s_cbv);
+    s_csa.swap(other.s_csa);
+    
+    i_iv.swap(other.i_iv);
+    r_iv.swap(other.r_iv);
+    
+    f_iv.swap(other.f_iv);
+    f_bv.swap(other.f_bv);
+    util::swap_support(f_bv_rank, other.f_bv_rank, &f_bv, &other.f_bv);
+    util::swap_support(f_bv_select, other.f_bv_select, &f_bv, &other.f_bv);
+    f_from_start_bv.swap(other.f_from_start_bv);
+    f_to_end_bv.swap(other.f_to_end_bv);
+    f_from_start_cbv.swap(other.f_from_start_cbv);
+    f_to_end_cbv.swap(other.f_to_end_cbv);
+    
+    t_iv.swap(other.t_iv);
+    t_bv.swap(other.t_bv);
+    util::swap_support(t_bv_rank, other.t_bv_rank, &t_bv, &other.t_bv);
+    util::swap_support(t_bv_select, other.t_bv_select, &t_bv, &other.t_bv);
+    t_from_start_bv.swap(other.t_from_start_bv);
+    t_to_end_bv.swap(other.t_to_end_bv);
+    t_from_start_cbv.swap(other.t_from_start_cbv);
+    nr_starts.swap(other.nr_starts);
+    nr_block.swap(other.nr_block);
+    t_to_end_cbv.swap(other.t_to_end_cbv);
+    
+    e_iv.swap(other.e_iv);
+    
+    pn_iv.swap(other.pn_iv);
+    pn_csa.swap(other.pn_csa);
+    pn_bv.swap(other.pn_bv);
+    util::swap_support(pn_bv_rank, other.pn_bv_rank, &pn_bv, &other.pn_bv);
+    util::swap_support(pn_bv_select, other.pn_bv_select, &pn_bv, &other.pn_bv);
+    pi_iv.swap(other.pi_iv);
+    
+    // XGPaths live on the heap, so their supports stay put
+    paths.swap(other.paths);
+    
+    ep_iv.swap(other.ep_iv);
+    ep_bv.swap(other.ep_bv);
+    util::swap_support(ep_bv_rank, other.ep_bv_rank, &ep_bv, &other.ep_bv);
+    util::swap_support(ep_bv_select, other.ep_bv_select, &ep_bv, &other.ep_bv);
+    
+    np_iv.swap(other.np_iv);
+    np_pos_iv.swap(other.np_pos_iv);
+    np_bv.swap(other.np_bv);
+    util::swap_support(np_bv_select, other.np_bv_select, &np_bv, &other.np_bv);
+    pj_starts.swap(other.pj_starts);
+    pj_iv.swap(other.pj_iv);
+    
+    h_iv.swap(other.h_iv);
+    ts_iv.swap(other.ts_iv);
+    wi_starts.swap(other.wi_starts);
+    wi_from_iv.swap(other.wi_from_iv);
+    wi_slot_iv.swap(other.wi_slot_iv);
+    wi_prefix_iv.swap(other.wi_prefix_iv);
+    wo_starts.swap(other.wo_starts);
+    wo_to_iv.swap(other.wo_to_iv);
+    bs_store.swap(other.bs_store);
+}
+
+shared_ptr<const XG> XGHandle::get(void) const {
+    return atomic_load(&current);
+}
+
+shared_ptr<const XG> XGHandle::replace(shared_ptr<const XG> index) {
+    return atomic_exchange(&current, index);
+}
 
+bool XGHandle::reload(const string& filename, string& error) {
+    ifstream in(filename);
     if (!in.good()) {
-        cerr << "[xg] error: index does not exist!" << endl;
+        error = "could not open " + filename;
+        return false;
+    }
+    // build the new index entirely before anyone can see it
+    auto loaded = make_shared<XG>();
+    try {
+        loaded->load_checked(in);
+    } catch (const exception& e) {
+        // a bad file can ask for absurd allocations as well as run short
+        error = "could not load " + filename + ": " + e.what();
+        return false;
+    }
+    replace(loaded);
+    return true;
+}
+
+void XG::load(istream& in) {
+    try {
+        load_checked(in);
+    } catch (const runtime_error& e) {
+        cerr << "[xg] error: " << e.what() << endl;
         exit(1);
     }
+}
+
+void XG::load_checked(istream& in) {
+
+    if (!in.good()) {
+        throw runtime_error("index does not exist!");
+    }
+    // The SDSL loaders don't check anything, so we look at the stream as we
+    // go, before anything read from a short stream gets used.
+    auto check = [&](const char* section) {
+        if (!in) {
+            throw runtime_error(string("index is truncated in the ") + section);
+        }
+    };
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    sdsl::read_member(magic, in);
+    if (!in || magic != FILE_MAGIC) {
+        throw runtime_error("not an xg index");
+    }
+    sdsl::read_member(version, in);
+    check("header");
+    if (version != FILE_VERSION) {
+        throw runtime_error("index is format version " + to_string(version)
+                            + ", but this xg reads version " + to_string(FILE_VERSION)
+                            + "; rebuild the index");
+    }
 
     sdsl::read_member(seq_length, in);
     sdsl::read_member(node_count, in);
@@ -119,6 +289,7 @@ void XG::load(istream& in) {
     //cerr << sequence_length << ", " << node_count << ", " << edge_count << endl;
     sdsl::read_member(min_id, in);
     sdsl::read_member(max_id, in);
+    check("header");
 
     i_iv.load(in);
     r_iv.load(in);
@@ -127,6 +298,8 @@ void XG::load(istream& in) {
     s_cbv.load(in);
     s_cbv_rank.load(in, &s_cbv);
     s_cbv_select.load(in, &s_cbv);
+    s_csa.load(in);
+    check("sequences");
 
     f_iv.load(in);
     f_bv.load(in);
@@ -141,6 +314,9 @@ void XG::load(istream& in) {
     t_bv_select.load(in, &t_bv);
     t_to_end_cbv.load(in);
     t_from_start_cbv.load(in);
+    nr_starts.load(in);
+    nr_block.load(in);
+    check("edges");
 
     pn_iv.load(in);
     pn_csa.load(in);
@@ -149,22 +325,45 @@ void XG::load(istream& in) {
     pn_bv_select.load(in, &pn_bv);
     pi_iv.load(in);
     sdsl::read_member(path_count, in);
+    check("path names");
     for (size_t i = 0; i < path_count; ++i) {
         auto path = new XGPath;
-        path->load(in);
         paths.push_back(path);
+        path->load(in);
+        check("paths");
     }
     ep_iv.load(in);
     ep_bv.load(in);
     ep_bv_rank.load(in, &ep_bv);
     ep_bv_select.load(in, &ep_bv);
+    np_iv.load(in);
+    np_pos_iv.load(in);
+    np_bv.load(in);
+    np_bv_select.load(in, &np_bv);
+    pj_starts.load(in);
+    pj_iv.load(in);
+    check("path memberships");
     
     h_iv.load(in);
     ts_iv.load(in);
 
-    // Load all the B_s arrays for sides.
+    // Load all the B_s arrays for sides, in whichever form they were built.
     // Baking required before serialization.
-    deserialize(bs_single_array, in);
+    int32_t bs_mode;
+    sdsl::read_member(bs_mode, in);
+    check("threads");
+    if (bs_mode != MODE_SDSL && bs_mode != MODE_DYNAMIC) {
+        throw runtime_error("unknown gPBWT mode " + to_string(bs_mode));
+    }
+    bs_store = BsStore::make(bs_mode, 0);
+    bs_store->load(in);
+    wi_starts.load(in);
+    wi_from_iv.load(in);
+    wi_slot_iv.load(in);
+    wi_prefix_iv.load(in);
+    wo_starts.load(in);
+    wo_to_iv.load(in);
+    check("threads");
 }
 
 void XGPath::load(istream& in) {
@@ -178,6 +377,9 @@ void XGPath::load(istream& in) {
     offsets.load(in);
     offsets_rank.load(in, &offsets);
     offsets_select.load(in, &offsets);
+    proj_ranks.load(in);
+    proj_positions.load(in);
+    proj_dists.load(in);
 }
 
 size_t XGPath::serialize(std::ostream& out,
@@ -193,6 +395,9 @@ size_t XGPath::serialize(std::ostream& out,
     written += offsets.serialize(out, child, "path_node_starts_" + name);
     written += offsets_rank.serialize(out, child, "path_node_starts_rank_" + name);
     written += offsets_select.serialize(out, child, "path_node_starts_select_" + name);
+    written += proj_ranks.serialize(out, child, "path_projected_ranks_" + name);
+    written += proj_positions.serialize(out, child, "path_projected_positions_" + name);
+    written += proj_dists.serialize(out, child, "path_projected_distances_" + name);
     
     sdsl::structure_tree::add_size(child, written);
     
@@ -327,11 +532,53 @@ Mapping XGPath::mapping(size_t offset) const {
     return m;
 }
 
+XGPath::StepIterator::StepIterator(const XGPath& path, size_t index, bool backward)
+    : path(&path),
+      backward(backward),
+      at_end(index >= path.ids.size()) {
+    step.index = index;
+    if (!at_end) load();
+}
+
+void XGPath::StepIterator::load(void) {
+    size_t i = step.index;
+    step.id = path->ids[i];
+    step.is_reverse = path->directions[i];
+    step.offset = path->positions[i];
+    // the next visit starts where this one ends
+    size_t next = i + 1 < path->positions.size() ? path->positions[i+1] : path->offsets.size();
+    step.length = next - step.offset;
+}
+
+XGPath::StepIterator& XGPath::StepIterator::operator++(void) {
+    if (at_end) return *this;
+    if (backward) {
+        if (step.index == 0) {
+            at_end = true;
+        } else {
+            --step.index;
+        }
+    } else {
+        at_end = ++step.index >= path->ids.size();
+    }
+    if (!at_end) load();
+    return *this;
+}
+
+XGPath::StepIterator XGPath::steps_from(size_t pos, bool backward) const {
+    if (pos >= offsets.size()) {
+        return StepIterator(*this, ids.size(), backward);
+    }
+    return StepIterator(*this, offsets_rank(pos+1)-1, backward);
+}
+
 size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string name) {
 
     sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(s, name, sdsl::util::class_name(*this));
     size_t written = 0;
 
+    written += sdsl::write_member(FILE_MAGIC, out, child, "magic");
+    written += sdsl::write_member(FILE_VERSION, out, child, "version");
     written += sdsl::write_member(s_iv.size(), out, child, "sequence_length");
     written += sdsl::write_member(i_iv.size(), out, child, "node_count");
     written += sdsl::write_member(f_iv.size()-i_iv.size(), out, child, "edge_count");
@@ -346,6 +593,7 @@ size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string nam
     written += s_cbv.serialize(out, child, "seq_node_starts");
     written += s_cbv_rank.serialize(out, child, "seq_node_starts_rank");
     written += s_cbv_select.serialize(out, child, "seq_node_starts_select");
+    written += s_csa.serialize(out, child, "seq_fm_index");
 
     written += f_iv.serialize(out, child, "from_vector");
     written += f_bv.serialize(out, child, "from_node");
@@ -360,6 +608,8 @@ size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string nam
     written += t_bv_select.serialize(out, child, "to_node_select");
     written += t_to_end_cbv.serialize(out, child, "to_is_to_end");
     written += t_from_start_cbv.serialize(out, child, "to_is_from_start");
+    written += nr_starts.serialize(out, child, "node_record_starts");
+    written += nr_block.serialize(out, child, "node_records");
 
     // Treat the paths as their own node
     size_t paths_written = 0;
@@ -381,6 +631,12 @@ size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string nam
     paths_written += ep_bv.serialize(out, paths_child, "entity_path_mapping_starts");
     paths_written += ep_bv_rank.serialize(out, paths_child, "entity_path_mapping_starts_rank");
     paths_written += ep_bv_select.serialize(out, paths_child, "entity_path_mapping_starts_select");
+    paths_written += np_iv.serialize(out, paths_child, "node_path_position_paths");
+    paths_written += np_pos_iv.serialize(out, paths_child, "node_path_position_offsets");
+    paths_written += np_bv.serialize(out, paths_child, "node_path_position_starts");
+    paths_written += np_bv_select.serialize(out, paths_child, "node_path_position_starts_select");
+    paths_written += pj_starts.serialize(out, paths_child, "node_projected_path_starts");
+    paths_written += pj_iv.serialize(out, paths_child, "node_projected_paths");
     
     sdsl::structure_tree::add_size(paths_child, paths_written);
     written += paths_written;
@@ -391,8 +647,20 @@ size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string nam
     size_t threads_written = 0;
     threads_written += h_iv.serialize(out, threads_child, "thread_usage_count");
     threads_written += ts_iv.serialize(out, threads_child, "thread_start_count");
-    // Stick all the B_s arrays in together. Must be baked.
-    threads_written += xg::serialize(bs_single_array, out, threads_child, "bs_single_array");
+    // Stick all the B_s arrays in together, saying how. Must be baked, so
+    // fold in anything added since.
+    if (!bs_store) {
+        bs_store = BsStore::make(GPBWT_MODE, 0);
+    }
+    bs_store->compact();
+    threads_written += sdsl::write_member((int32_t) bs_store->mode(), out, threads_child, "bs_mode");
+    threads_written += bs_store->serialize(out, threads_child, "bs_store");
+    threads_written += wi_starts.serialize(out, threads_child, "side_in_edge_starts");
+    threads_written += wi_from_iv.serialize(out, threads_child, "side_in_edge_from");
+    threads_written += wi_slot_iv.serialize(out, threads_child, "side_in_edge_usage_slot");
+    threads_written += wi_prefix_iv.serialize(out, threads_child, "side_in_edge_usage_prefix");
+    threads_written += wo_starts.serialize(out, threads_child, "side_out_edge_starts");
+    threads_written += wo_to_iv.serialize(out, threads_child, "side_out_edge_to");
     
     sdsl::structure_tree::add_size(threads_child, threads_written);
     written += threads_written;
@@ -403,27 +671,28 @@ size_t XG::serialize(ostream& out, sdsl::structure_tree_node* s, std::string nam
 }
 
 void XG::from_stream(istream& in, bool validate_graph, bool print_graph,
-    bool store_threads, bool is_sorted_dag) {
+    bool store_threads, bool is_sorted_dag, bool order_by_locality, int gpbwt_mode) {
 
     from_callback([&](function<void(Graph&)> handle_chunk) {
         // TODO: should I be bandying about function references instead of
         // function objects here?
         stream::for_each(in, handle_chunk);
-    }, validate_graph, print_graph, store_threads, is_sorted_dag);
+    }, validate_graph, print_graph, store_threads, is_sorted_dag, order_by_locality, gpbwt_mode);
 }
 
 void XG::from_graph(Graph& graph, bool validate_graph, bool print_graph,
-    bool store_threads, bool is_sorted_dag) {
+    bool store_threads, bool is_sorted_dag, bool order_by_locality, int gpbwt_mode) {
 
     from_callback([&](function<void(Graph&)> handle_chunk) {
         // There's only one chunk in this case.
         handle_chunk(graph);
-    }, validate_graph, print_graph, store_threads, is_sorted_dag);
+    }, validate_graph, print_graph, store_threads, is_sorted_dag, order_by_locality, gpbwt_mode);
 
 }
 
 void XG::from_callback(function<void(function<void(Graph&)>)> get_chunks, 
-    bool validate_graph, bool print_graph, bool store_threads, bool is_sorted_dag) {
+    bool validate_graph, bool print_graph, bool store_threads, bool is_sorted_dag,
+    bool order_by_locality, int gpbwt_mode) {
 
     // temporaries for construction
     map<id_t, string> node_label;
@@ -500,10 +769,58 @@ void XG::from_callback(function<void(function<void(Graph&)>)> get_chunks,
     }
 
     build(node_label, from_to, to_from, path_nodes, validate_graph, print_graph,
-        store_threads, is_sorted_dag);
+        store_threads, is_sorted_dag, order_by_locality, gpbwt_mode);
     
 }
 
+vector<id_t> XG::topological_order(const map<id_t, string>& node_label,
+                                   const map<side_t, set<side_t> >& from_to) const {
+    // Kahn's algorithm, taking edges as running from their from node to their
+    // to node whatever their sides. Each node's successors then tend to land
+    // right after it in rank.
+    map<id_t, size_t> in_degree;
+    for (auto& p : node_label) {
+        in_degree[p.first] = 0;
+    }
+    for (auto& f : from_to) {
+        for (auto& t : f.second) {
+            if (side_id(t) != side_id(f.first)) {
+                ++in_degree[side_id(t)];
+            }
+        }
+    }
+    vector<id_t> order;
+    order.reserve(node_label.size());
+    map<id_t, bool> placed;
+    queue<id_t> ready;
+    for (auto& d : in_degree) {
+        if (d.second == 0) ready.push(d.first);
+    }
+    auto next_unplaced = node_label.begin();
+    while (order.size() < node_label.size()) {
+        if (ready.empty()) {
+            // we're stuck in a cycle, so break it at the lowest id left
+            while (placed.count(next_unplaced->first)) ++next_unplaced;
+            ready.push(next_unplaced->first);
+        }
+        id_t id = ready.front();
+        ready.pop();
+        if (placed.count(id)) continue;
+        placed[id] = true;
+        order.push_back(id);
+        for (auto is_start : { false, true }) {
+            auto f = from_to.find(make_side(id, is_start));
+            if (f == from_to.end()) continue;
+            for (auto& t : f->second) {
+                id_t next = side_id(t);
+                if (next == id || placed.count(next)) continue;
+                if (--in_degree[next] == 0) ready.push(next);
+            }
+        }
+    }
+    return order;
+}
+
 void XG::build(map<id_t, string>& node_label,
                map<side_t, set<side_t> >& from_to,
                map<side_t, set<side_t> >& to_from,
@@ -511,7 +828,9 @@ void XG::build(map<id_t, string>& node_label,
                bool validate_graph,
                bool print_graph,
                bool store_threads,
-               bool is_sorted_dag) {
+               bool is_sorted_dag,
+               bool order_by_locality,
+               int gpbwt_mode) {
 
     size_t entity_count = node_count + edge_count;
 #ifdef VERBOSE_DEBUG
@@ -545,11 +864,20 @@ void XG::build(map<id_t, string>& node_label,
 #ifdef VERBOSE_DEBUG
     cerr << "storing node labels" << endl;
 #endif
+    // ranks follow the ids unless we're asked to keep neighbors together
+    vector<id_t> rank_order;
+    if (order_by_locality) {
+        rank_order = topological_order(node_label, from_to);
+    } else {
+        rank_order.reserve(node_count);
+        for (auto& p : node_label) {
+            rank_order.push_back(p.first);
+        }
+    }
     size_t i = 0; // insertion point
     size_t r = 1;
-    for (auto& p : node_label) {
-        int64_t id = p.first;
-        const string& l = p.second;
+    for (auto id : rank_order) {
+        const string& l = node_label[id];
         s_bv[i] = 1; // record node start
         i_iv[r-1] = id;
         // store ids to rank mapping
@@ -681,11 +1009,9 @@ void XG::build(map<id_t, string>& node_label,
     util::assign(h_iv, int_vector<>(entity_count * 2, 0));
     util::assign(ts_iv, int_vector<>((node_count + 1) * 2, 0));
     
-#if GPBWT_MODE == MODE_SDSL
     // We have one B_s array for every side, but the first 2 numbers for sides
     // are unused. But max node rank is inclusive, so it evens out...
-    bs_arrays.resize(max_node_rank() * 2);
-#endif
+    bs_store = BsStore::make(gpbwt_mode, max_node_rank() * 2);
 
 #ifdef VERBOSE_DEBUG
     cerr << "storing paths" << endl;
@@ -751,6 +1077,9 @@ void XG::build(map<id_t, string>& node_label,
         cerr << "storing threads" << endl;
 #endif
     
+        // Lay out the edges on each side so where_to doesn't have to
+        index_thread_edges();
+    
         // If we're a sorted DAG we'll batch up the paths and use a batch
         // insert.
         vector<thread_t> batch;
@@ -768,26 +1097,26 @@ void XG::build(map<id_t, string>& node_label,
                 reconstructed.push_back(mapping);
             }
             
-#if GPBWT_MODE == MODE_SDSL
-            if(is_sorted_dag) {
+            if(gpbwt_mode == MODE_SDSL) {
                 // Save for a batch insert
                 batch.push_back(reconstructed);
+            } else {
+                // Insert the thread right now
+                insert_thread(reconstructed);
             }
-            // TODO: else case!
-#elif GPBWT_MODE == MODE_DYNAMIC
-            // Insert the thread right now
-            insert_thread(reconstructed);
-#endif
             
         }
         
-#if GPBWT_MODE == MODE_SDSL
-        if(is_sorted_dag) {
+        if(gpbwt_mode != MODE_SDSL) {
+            // The usage counts are final now
+            index_thread_edge_prefixes();
+        } else if(is_sorted_dag) {
             // Do the batch insert
             insert_threads_into_dag(batch);
+        } else {
+            // Do the general batch insert
+            insert_threads(batch);
         }
-        // TODO: else case!
-#endif
     }
     
 
@@ -1003,11 +1332,7 @@ void XG::build(map<id_t, string>& node_label,
             // check membership now for each entity in the path
         }
         
-#if GPBWT_MODE == MODE_SDSL
-        if(store_threads && is_sorted_dag) {
-#elif GPBWT_MODE == MODE_DYNAMIC
         if(store_threads) {
-#endif
         
             cerr << "validating threads" << endl;
             
@@ -1016,6 +1341,8 @@ void XG::build(map<id_t, string>& node_label,
             // And how many shoukd we have inserted?
             size_t threads_expected = 0;
             
+            // Search for all the threads we find, both ways, in one batch
+            vector<thread_t> searches;
             for(auto thread : extract_threads()) {
 #ifdef VERBOSE_DEBUG
                 cerr << "Thread: ";
@@ -1025,8 +1352,7 @@ void XG::build(map<id_t, string>& node_label,
                 }
                 cerr << endl;
 #endif
-                // Make sure we can search all the threads we find present in the index
-                assert(count_matches(thread) > 0);
+                searches.push_back(thread);
                 
                 // Flip the thread around
                 reverse(thread.begin(), thread.end());
@@ -1035,11 +1361,16 @@ void XG::build(map<id_t, string>& node_label,
                 }
                 
                 // We need to be able to find it backwards as well
-                assert(count_matches(thread) > 0);
+                searches.push_back(thread);
                 
                 threads_found++;
             }
             
+            for(auto count : count_matches(searches)) {
+                // Make sure we can search all the threads we find present in the index
+                assert(count > 0);
+            }
+            
             for (auto& pathpair : path_nodes) {
                 Path reconstructed;
                 
@@ -1069,20 +1400,167 @@ Node XG::node(int64_t id) const {
     return n;
 }
 
+string XG::strand_sequence(size_t rank, bool is_rev) const {
+    string seq;
+    if (!nr_starts.empty()) {
+        size_t record = nr_starts[rank-1];
+        append_sequence(nr_block[record], nr_block[record] + nr_block[record+1], seq);
+        return is_rev ? reverse_complement(seq) : seq;
+    }
+    size_t end = rank == node_count ? s_iv.size() : s_cbv_select(rank+1);
+    append_sequence(s_cbv_select(rank), end, seq);
+    return is_rev ? reverse_complement(seq) : seq;
+}
+
+void XG::for_each_kmer(size_t k, const function<void(const string&, const vector<pos_t>&)>& lambda,
+                       size_t branch_max) const {
+    if (k == 0) return;
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t rank = 1; rank <= node_count; ++rank) {
+        int64_t id = rank_to_id(rank);
+        for (bool is_rev : { false, true }) {
+            string seq = strand_sequence(rank, is_rev);
+            // every walk onward from the end of this strand out to k-1 bases,
+            // or less where the graph runs out or the walk runs out of
+            // branches first
+            vector<pair<string, vector<pos_t> > > tails;
+            string tail;
+            vector<pos_t> tail_pos;
+            function<void(size_t, bool, size_t)> extend = [&](size_t from_rank, bool from_rev, size_t branches) {
+                // we leave a forward node by its end, a reverse one by its start
+                vector<pair<size_t, bool> > next;
+                for_each_edge_on_side(from_rank, !from_rev, [&](size_t next_rank, bool enters_end) {
+                        next.push_back(make_pair(next_rank, enters_end));
+                    });
+                if (next.size() > 1) ++branches;
+                if (next.empty() || branches > branch_max) {
+                    // k-mers needing more than this are left out
+                    if (!tail.empty()) tails.push_back(make_pair(tail, tail_pos));
+                    return;
+                }
+                for (auto& step : next) {
+                    // coming in at the end means reading the node backward
+                    string next_seq = strand_sequence(step.first, step.second);
+                    int64_t next_id = rank_to_id(step.first);
+                    size_t take = min(next_seq.size(), k - 1 - tail.size());
+                    for (size_t i = 0; i < take; ++i) {
+                        tail.push_back(next_seq[i]);
+                        tail_pos.push_back(make_pos(next_id, step.second, i));
+                    }
+                    if (tail.size() < k - 1) {
+                        extend(step.first, step.second, branches);
+                    } else {
+                        tails.push_back(make_pair(tail, tail_pos));
+                    }
+                    tail.resize(tail.size() - take);
+                    tail_pos.resize(tail_pos.size() - take);
+                }
+            };
+            if (k > 1) extend(rank, is_rev, 0);
+            vector<pos_t> positions;
+            for (size_t off = 0; off < seq.size(); ++off) {
+                positions.clear();
+                for (size_t i = off; i < seq.size() && i < off + k; ++i) {
+                    positions.push_back(make_pos(id, is_rev, i));
+                }
+                if (off + k <= seq.size()) {
+                    lambda(seq.substr(off, k), positions);
+                    continue;
+                }
+                // the rest comes from the walks, which may agree on the bases
+                size_t need = k - (seq.size() - off);
+                set<string> seen;
+                for (auto& t : tails) {
+                    if (t.first.size() < need) continue;
+                    string kmer = seq.substr(off) + t.first.substr(0, need);
+                    if (!seen.insert(kmer).second) continue;
+                    positions.resize(seq.size() - off);
+                    positions.insert(positions.end(), t.second.begin(), t.second.begin() + need);
+                    lambda(kmer, positions);
+                }
+            }
+        }
+    }
+}
+
+void XG::index_sequence_search(void) {
+    // the forward sequence, then the reverse complement of the whole thing
+    string text;
+    append_sequence(0, s_iv.size(), text);
+    text += reverse_complement(text);
+    construct_im(s_csa, text, 1);
+}
+
+bool XG::has_sequence_search(void) const {
+    return s_csa.size() > 0;
+}
+
+vector<pos_t> XG::find_sequence(const string& pattern) const {
+    vector<pos_t> hits;
+    if (!has_sequence_search() || pattern.empty()) return hits;
+    string query = pattern;
+    std::transform(query.begin(), query.end(), query.begin(), ::toupper);
+    size_t n = s_iv.size();
+    size_t len = query.size();
+    auto node_end = [&](size_t rank) {
+        return rank == node_count ? n : (size_t)s_cbv_select(rank+1);
+    };
+    for (auto p : locate(s_csa, query.begin(), query.end())) {
+        if (p < n) {
+            size_t rank = s_cbv_rank(p+1);
+            // drop hits running off the end of the node
+            if (p + len > node_end(rank)) continue;
+            hits.push_back(make_pos(rank_to_id(rank), false, p - s_cbv_select(rank)));
+        } else {
+            // on the reverse complement, the hit covers these forward bases
+            size_t last = n - 1 - (p - n);
+            size_t first = last + 1 - len;
+            size_t rank = s_cbv_rank(last+1);
+            if (first < s_cbv_select(rank)) continue;
+            hits.push_back(make_pos(rank_to_id(rank), true, node_end(rank) - 1 - last));
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+void XG::append_sequence(size_t start, size_t end, string& seq) const {
+    end = min(end, (size_t)s_iv.size());
+    if (start >= end) return;
+    seq.reserve(seq.size() + end - start);
+    // pull out as many packed bases as fit in a word at a time
+    uint8_t width = s_iv.width();
+    size_t per_word = 64 / width;
+    uint64_t mask = bits::lo_set[width];
+    for (size_t i = start; i < end; ) {
+        size_t n = min(per_word, end - i);
+        uint64_t word = s_iv.get_int(i * width, n * width);
+        for (size_t j = 0; j < n; ++j) {
+            seq.push_back(revdna3bit(word & mask));
+            word >>= width;
+        }
+        i += n;
+    }
+}
+
 string XG::node_sequence(int64_t id) const {
     size_t rank = id_to_rank(id);
     assert(rank != 0); // We can crash if we try to look up rank 0.
+    if (!nr_starts.empty()) {
+        return strand_sequence(rank, false);
+    }
     size_t start = s_cbv_select(rank);
     size_t end = rank == node_count ? s_cbv.size() : s_cbv_select(rank+1);
-    string s; s.resize(end-start);
-    for (size_t i = start; i < s_cbv.size() && i < end; ++i) {
-        s[i-start] = revdna3bit(s_iv[i]);
-    }
+    string s;
+    append_sequence(start, end, s);
     return s;
 }
 
 size_t XG::node_length(int64_t id) const {
     size_t rank = id_to_rank(id);
+    if (!nr_starts.empty()) {
+        return nr_block[nr_starts[rank-1] + 1];
+    }
     size_t start = s_cbv_select(rank);
     size_t end = rank == node_count ? s_cbv.size() : s_cbv_select(rank+1);
     return end-start;
@@ -1118,10 +1596,8 @@ string XG::pos_substr(int64_t id, bool is_rev, size_t off, size_t len) const {
             end = min(start + len, (size_t)s_cbv_select(rank+1));
         }
         assert(end < s_iv.size());
-        string s; s.resize(end-start);
-        for (size_t i = start; i < s_cbv.size() && i < end; ++i) {
-            s[i-start] = revdna3bit(s_iv[i]);
-        }
+        string s;
+        append_sequence(start, end, s);
         return s;
     } else {
         size_t rank = id_to_rank(id);
@@ -1135,14 +1611,16 @@ string XG::pos_substr(int64_t id, bool is_rev, size_t off, size_t len) const {
             start = max(end - len, (size_t)s_cbv_select(rank));
         }
         assert(end < s_iv.size());
-        string s; s.resize(end-start);
-        for (size_t i = start; i < s_cbv.size() && i < end; ++i) {
-            s[i-start] = revdna3bit(s_iv[i]);
-        }
+        string s;
+        append_sequence(start, end, s);
         return reverse_complement(s);
     }
 }
 
+bool XG::has_node(int64_t id) const {
+    return id >= min_id && id <= max_id && id_to_rank(id) != 0;
+}
+
 size_t XG::id_to_rank(int64_t id) const {
     return r_iv[id-min_id];
 }
@@ -1180,6 +1658,21 @@ vector<Edge> XG::edges_of(int64_t id) const {
 vector<Edge> XG::edges_to(int64_t id) const {
     vector<Edge> edges;
     size_t rank = id_to_rank(id);
+    if (!nr_starts.empty()) {
+        // the edges recorded to us come after those recorded from us
+        size_t record = nr_starts[rank-1];
+        size_t end = record + 4 + nr_block[record + 2];
+        for (size_t i = record + 4 + nr_block[record + 3]; i < end; ++i) {
+            uint64_t packed = nr_block[i];
+            Edge edge;
+            edge.set_to(id);
+            edge.set_from(rank_to_id(packed >> 2));
+            edge.set_from_start(!(packed & 1));
+            edge.set_to_end(packed & 2);
+            edges.push_back(edge);
+        }
+        return edges;
+    }
     size_t t_start = t_bv_select(rank)+1;
     size_t t_end = rank == node_count ? t_bv.size() : t_bv_select(rank+1);
     for (size_t i = t_start; i < t_end; ++i) {
@@ -1196,6 +1689,20 @@ vector<Edge> XG::edges_to(int64_t id) const {
 vector<Edge> XG::edges_from(int64_t id) const {
     vector<Edge> edges;
     size_t rank = id_to_rank(id);
+    if (!nr_starts.empty()) {
+        size_t record = nr_starts[rank-1];
+        size_t end = record + 4 + nr_block[record + 3];
+        for (size_t i = record + 4; i < end; ++i) {
+            uint64_t packed = nr_block[i];
+            Edge edge;
+            edge.set_from(id);
+            edge.set_to(rank_to_id(packed >> 2));
+            edge.set_from_start(!(packed & 2));
+            edge.set_to_end(packed & 1);
+            edges.push_back(edge);
+        }
+        return edges;
+    }
     size_t f_start = f_bv_select(rank)+1;
     size_t f_end = rank == node_count ? f_bv.size() : f_bv_select(rank+1);
     for (size_t i = f_start; i < f_end; ++i) {
@@ -1352,17 +1859,16 @@ Path XG::path(const string& name) const {
     // Fill in the name
     to_return.set_name(name);
     
-    // There's one ID entry per node visit    
-    size_t total_nodes = xgpath.ids.size();
-    
-    for(size_t i = 0; i < total_nodes; i++) {
+    for (auto step = xgpath.steps_from(0); !step.done(); ++step) {
         // For everything on the XGPath, put a Mapping on the real path.
         Mapping* m = to_return.add_mapping();
-        *m = xgpath.mapping(i);
-        // Add one full length match edit, because the XGPath doesn't know how
-        // to make it.
+        m->mutable_position()->set_node_id(step->id);
+        m->mutable_position()->set_is_reverse(step->is_reverse);
+        m->set_rank(xgpath.ranks[step->index]);
+        // Add one full length match edit, with the length the path itself
+        // records for the visit.
         Edit* e = m->add_edit();
-        e->set_from_length(node_length(m->position().node_id()));
+        e->set_from_length(step->length);
         e->set_to_length(e->from_length());
     }
     
@@ -1773,7 +2279,7 @@ void XG::get_id_range_by_length(int64_t id, int64_t length, Graph& g, bool forwa
 
     // get the id range
     if (!forward) {
-        swap(id, id2);
+        std::swap(id, id2);
     }
     get_id_range(id, id2, g);
 }
@@ -1864,39 +2370,324 @@ int64_t XG::prev_path_node_by_id(size_t path_rank, int64_t id) const {
     return prev_id;
 }
 
-// estimate distance (in bp) between two nodes along a path.
-// if a nodes isn't on the path, the nearest node on the path (using id space)
-// is used as a proxy.  In this case, the distance may not be exact
-// due to this heuristic, but should be sufficient for our purposese (evaluating
-// pair consistency).
-// returns -1 if couldn't find distance
-int64_t XG::approx_path_distance(const string& name, int64_t id1, int64_t id2) const {
-    // simplifying assumption: id1 lies before id2 on path (and id space)
-    if (id1 > id2) {
-        swap(id1, id2);
+void XG::index_node_records(void) {
+    // lay out the records one after another, in rank order
+    vector<uint64_t> block;
+    vector<size_t> starts;
+    starts.reserve(node_count + 1);
+    for (size_t rank = 1; rank <= node_count; ++rank) {
+        starts.push_back(block.size());
+        size_t seq_start = s_cbv_select(rank);
+        size_t seq_end = rank == node_count ? s_cbv.size() : s_cbv_select(rank+1);
+        block.push_back(seq_start);
+        block.push_back(seq_end - seq_start);
+        size_t count_at = block.size();
+        block.push_back(0);
+        block.push_back(0);
+        // each edge as other rank << 2 | our side is_end << 1 | their side is_end,
+        // in the order the edge tables give them
+        size_t f_start = f_bv_select(rank)+1;
+        size_t f_end = rank == node_count ? f_bv.size() : f_bv_select(rank+1);
+        for (size_t i = f_start; i < f_end; ++i) {
+            block.push_back((uint64_t)f_iv[i] << 2 | (uint64_t)!f_from_start_cbv[i] << 1 | f_to_end_cbv[i]);
+        }
+        block[count_at + 1] = f_end - f_start;
+        size_t t_start = t_bv_select(rank)+1;
+        size_t t_end = rank == node_count ? t_bv.size() : t_bv_select(rank+1);
+        for (size_t i = t_start; i < t_end; ++i) {
+            block.push_back((uint64_t)t_iv[i] << 2 | (uint64_t)t_to_end_cbv[i] << 1 | !t_from_start_cbv[i]);
+        }
+        block[count_at] = block.size() - count_at - 2;
+    }
+    starts.push_back(block.size());
+    util::assign(nr_block, int_vector<>(block.size()));
+    for (size_t i = 0; i < block.size(); ++i) {
+        nr_block[i] = block[i];
+    }
+    util::bit_compress(nr_block);
+    util::assign(nr_starts, int_vector<>(starts.size()));
+    for (size_t i = 0; i < starts.size(); ++i) {
+        nr_starts[i] = starts[i];
+    }
+    util::bit_compress(nr_starts);
+}
+
+void XG::for_each_edge_on_side(size_t rank, bool is_end,
+                               const function<void(size_t, bool)>& lambda) const {
+    if (!nr_starts.empty()) {
+        size_t record = nr_starts[rank-1];
+        size_t edges = nr_block[record + 2];
+        for (size_t i = record + 4; i < record + 4 + edges; ++i) {
+            uint64_t edge = nr_block[i];
+            if ((bool)(edge & 2) == is_end) {
+                lambda(edge >> 2, edge & 1);
+            }
+        }
+        return;
+    }
+    // edges recorded from this node leave from its end unless from_start
+    size_t f_start = f_bv_select(rank)+1;
+    size_t f_end = rank == node_count ? f_bv.size() : f_bv_select(rank+1);
+    for (size_t i = f_start; i < f_end; ++i) {
+        if (f_from_start_cbv[i] != is_end) {
+            lambda(f_iv[i], f_to_end_cbv[i]);
+        }
+    }
+    // edges recorded to this node arrive at its start unless to_end
+    size_t t_start = t_bv_select(rank)+1;
+    size_t t_end = rank == node_count ? t_bv.size() : t_bv_select(rank+1);
+    for (size_t i = t_start; i < t_end; ++i) {
+        if (t_to_end_cbv[i] == is_end) {
+            lambda(t_iv[i], !t_from_start_cbv[i]);
+        }
     }
-    size_t path_rank = this->path_rank(name);
-    int64_t next1 = next_path_node_by_id(path_rank, id1);
-    int64_t prev2 = prev_path_node_by_id(path_rank, id2);
+}
 
-    // fail
-    if (next1 == 0 || prev2 == 0) {
-        assert(false); // for now
-        return -1;
+bool XGPath::projection(size_t node_rank, size_t& pos, size_t& dist) const {
+    auto found = std::lower_bound(proj_ranks.begin(), proj_ranks.end(), node_rank);
+    if (found == proj_ranks.end() || *found != node_rank) {
+        return false;
+    }
+    size_t i = found - proj_ranks.begin();
+    pos = proj_positions[i];
+    dist = proj_dists[i];
+    return true;
+}
+
+void XG::index_path_projections(size_t max_distance) {
+    auto length_of_rank = [&](size_t rank) {
+        size_t end = rank == node_count ? s_cbv.size() : s_cbv_select(rank+1);
+        return end - s_cbv_select(rank);
+    };
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t p = 0; p < paths.size(); ++p) {
+        XGPath& path = *paths[p];
+        // distance, side (rank*2 + is_end), and the path position it hangs off
+        typedef tuple<size_t, int64_t, size_t> entry_t;
+        priority_queue<entry_t, vector<entry_t>, greater<entry_t> > queue;
+        hash_map<int64_t, bool> on_path;
+        // seed with both sides of every visit, at the path positions they touch
+        for (size_t i = 0; i < path.ids.size(); ++i) {
+            size_t rank = id_to_rank(path.ids[i]);
+            size_t start = path.positions[i];
+            size_t end = start + length_of_rank(rank);
+            bool is_rev = path.directions[i];
+            on_path[rank] = true;
+            queue.push(make_tuple(0, rank*2, is_rev ? end : start));
+            queue.push(make_tuple(0, rank*2+1, is_rev ? start : end));
+        }
+        hash_map<int64_t, bool> settled;
+        // the first time we reach an off-path node is its nearest approach
+        map<size_t, pair<size_t, size_t> > projected;
+        while (!queue.empty()) {
+            size_t dist, pos;
+            int64_t side;
+            tie(dist, side, pos) = queue.top();
+            queue.pop();
+            if (settled.count(side)) continue;
+            settled[side] = true;
+            for_each_edge_on_side(side/2, side%2, [&](size_t rank, bool is_end) {
+                    if (on_path.count(rank)) return;
+                    if (!projected.count(rank)) {
+                        projected[rank] = make_pair(pos, dist);
+                    }
+                    // carry on out the far side of the node
+                    size_t next = dist + length_of_rank(rank);
+                    int64_t exit = rank*2 + !is_end;
+                    if (next <= max_distance && !settled.count(exit)) {
+                        queue.push(make_tuple(next, exit, pos));
+                    }
+                });
+        }
+        util::assign(path.proj_ranks, int_vector<>(projected.size()));
+        util::assign(path.proj_positions, int_vector<>(projected.size()));
+        util::assign(path.proj_dists, int_vector<>(projected.size()));
+        size_t i = 0;
+        for (auto& proj : projected) {
+            path.proj_ranks[i] = proj.first;
+            path.proj_positions[i] = proj.second.first;
+            path.proj_dists[i] = proj.second.second;
+            ++i;
+        }
+        util::bit_compress(path.proj_ranks);
+        util::bit_compress(path.proj_positions);
+        util::bit_compress(path.proj_dists);
+    }
+    
+    // invert the projections, so a node's paths can be found without asking
+    // every path; walking the paths in order leaves each run sorted
+    util::assign(pj_starts, int_vector<>(node_count + 1, 0));
+    for (auto path : paths) {
+        for (size_t i = 0; i < path->proj_ranks.size(); ++i) {
+            ++pj_starts[path->proj_ranks[i]];
+        }
+    }
+    for (size_t rank = 1; rank <= node_count; ++rank) {
+        pj_starts[rank] += pj_starts[rank-1];
+    }
+    util::assign(pj_iv, int_vector<>(pj_starts[node_count]));
+    vector<size_t> next(pj_starts.begin(), pj_starts.end() - 1);
+    for (size_t p = 0; p < paths.size(); ++p) {
+        auto& path = *paths[p];
+        for (size_t i = 0; i < path.proj_ranks.size(); ++i) {
+            pj_iv[next[path.proj_ranks[i] - 1]++] = p + 1;
+        }
+    }
+    util::bit_compress(pj_starts);
+    util::bit_compress(pj_iv);
+}
+
+vector<size_t> XG::paths_projected_from(int64_t id) const {
+    vector<size_t> ranks;
+    if (pj_starts.empty() || !has_node(id)) return ranks;
+    size_t rank = id_to_rank(id);
+    for (size_t i = pj_starts[rank-1]; i < pj_starts[rank]; ++i) {
+        ranks.push_back(pj_iv[i]);
+    }
+    return ranks;
+}
+
+XG::NodePathVisits XG::node_path_visits(int64_t id, size_t only_path_rank) const {
+    NodePathVisits visits;
+    visits.id = id;
+    if (!has_node(id)) return visits;
+    int64_t length = node_length(id);
+    if (!np_bv.empty()) {
+        for (auto& visit : node_path_positions(id)) {
+            size_t prank = get<0>(visit);
+            if (only_path_rank && prank != only_path_rank) continue;
+            if (visits.path_ranks.empty() || visits.path_ranks.back() != prank) {
+                visits.path_ranks.push_back(prank);
+                visits.intervals.emplace_back();
+            }
+            int64_t pos = get<1>(visit);
+            visits.intervals.back().push_back(make_pair(pos, pos + length));
+        }
+        return visits;
+    }
+    vector<size_t> ranks = only_path_rank ? vector<size_t>(1, only_path_rank) : paths_of_node(id);
+    std::sort(ranks.begin(), ranks.end());
+    for (auto rank : ranks) {
+        if (!paths[rank-1]->members[node_rank_as_entity(id)-1]) continue;
+        visits.path_ranks.push_back(rank);
+        visits.intervals.emplace_back();
+        for (auto pos : node_positions_in_path(id, rank)) {
+            visits.intervals.back().push_back(make_pair(pos, pos + length));
+        }
+    }
+    return visits;
+}
+
+// the smallest gap between any [start, end) interval in one sorted list and
+// any in the other, or 0 if they overlap
+static int64_t closest_gap(const vector<pair<int64_t, int64_t> >& intervals1,
+                           const vector<pair<int64_t, int64_t> >& intervals2) {
+    // the gap only grows as we move away from a visit in either direction, so
+    // only the neighbors of each visit in the other list need checking
+    int64_t best = numeric_limits<int64_t>::max();
+    for (auto& a : intervals1) {
+        auto b = std::lower_bound(intervals2.begin(), intervals2.end(), a);
+        if (b != intervals2.end()) {
+            best = min(best, max((int64_t)0, b->first - a.second));
+        }
+        if (b != intervals2.begin()) {
+            --b;
+            best = min(best, max((int64_t)0, a.first - b->second));
+        }
     }
+    return best;
+}
 
-    // find our positions on the path
-    vector<size_t> positions1 = node_positions_in_path(next1, name);
-    vector<size_t> positions2 = node_positions_in_path(prev2, name);
-    // use the last node1 position and first node2 position. 
-    int64_t pos1 = (int64_t)positions1.back();
-    int64_t pos2 = (int64_t)positions2[0];
-    // shift over to the right of the left node if it's unchanged, and distinct from the right node.
-    if (next1 == id1 && next1 != prev2) {
-        pos1 += node_length(next1);
+int64_t XG::path_distance(size_t path_rank, const NodePathVisits& visits1,
+                          const NodePathVisits& visits2) const {
+    if (path_rank == 0 || path_rank > paths.size()
+        || !has_node(visits1.id) || !has_node(visits2.id)) {
+        return -1;
+    }
+    const XGPath& path = *paths[path_rank-1];
+    // visits on the path come from the cache, otherwise we use the projection
+    vector<pair<int64_t, int64_t> > projected1, projected2;
+    auto placements = [&](const NodePathVisits& visits,
+                          vector<pair<int64_t, int64_t> >& projected,
+                          int64_t& extra) -> const vector<pair<int64_t, int64_t> >* {
+        extra = 0;
+        auto found = std::lower_bound(visits.path_ranks.begin(), visits.path_ranks.end(), path_rank);
+        if (found != visits.path_ranks.end() && *found == path_rank) {
+            return &visits.intervals[found - visits.path_ranks.begin()];
+        }
+        size_t pos, dist;
+        if (path.projection(id_to_rank(visits.id), pos, dist)) {
+            projected.push_back(make_pair(pos, pos));
+            extra = dist;
+            return &projected;
+        }
+        return nullptr;
+    };
+    int64_t extra1, extra2;
+    auto intervals1 = placements(visits1, projected1, extra1);
+    auto intervals2 = placements(visits2, projected2, extra2);
+    if (!intervals1 || !intervals2) {
+        return -1;
     }
+    return closest_gap(*intervals1, *intervals2) + extra1 + extra2;
+}
+
+// distance in bp between two nodes along a path: the gap between the end of
+// the earlier and the start of the later, over their closest pair of visits.
+// nodes off the path stand in at their projections, plus the distance to them.
+// returns -1 if either node can't be placed on the path
+int64_t XG::path_distance(size_t path_rank, int64_t id1, int64_t id2) const {
+    if (path_rank == 0 || path_rank > paths.size()) return -1;
+    return path_distance(path_rank,
+                         node_path_visits(id1, path_rank),
+                         node_path_visits(id2, path_rank));
+}
+
+int64_t XG::approx_path_distance(const string& name, int64_t id1, int64_t id2) const {
+    return path_distance(path_rank(name), id1, id2);
+}
 
-    return abs(pos2 - pos1);
+int64_t XG::min_path_distance(const NodePathVisits& visits1, const NodePathVisits& visits2,
+                              const vector<size_t>& allowed) const {
+    if (!has_node(visits1.id) || !has_node(visits2.id)) {
+        return -1;
+    }
+    int64_t best = -1;
+    auto consider = [&](const vector<size_t>& ranks) {
+        for (auto rank : ranks) {
+            if (!allowed.empty() && !std::binary_search(allowed.begin(), allowed.end(), rank)) continue;
+            int64_t dist = path_distance(rank, visits1, visits2);
+            if (dist >= 0 && (best < 0 || dist < best)) {
+                best = dist;
+            }
+        }
+    };
+    auto& paths1 = visits1.path_ranks;
+    auto& paths2 = visits2.path_ranks;
+    // first the paths through both nodes
+    vector<size_t> both;
+    std::set_intersection(paths1.begin(), paths1.end(), paths2.begin(), paths2.end(),
+                          std::back_inserter(both));
+    consider(both);
+    if (best >= 0) return best;
+    // then those through either, using the projection of the other node
+    vector<size_t> either;
+    std::set_union(paths1.begin(), paths1.end(), paths2.begin(), paths2.end(),
+                   std::back_inserter(either));
+    consider(either);
+    if (best >= 0) return best;
+    // and finally whatever paths the two project onto, which the projection
+    // index knows without asking every path
+    auto proj1 = paths_projected_from(visits1.id);
+    auto proj2 = paths_projected_from(visits2.id);
+    vector<size_t> projected;
+    std::set_union(proj1.begin(), proj1.end(), proj2.begin(), proj2.end(),
+                   std::back_inserter(projected));
+    vector<size_t> unseen;
+    std::set_difference(projected.begin(), projected.end(), either.begin(), either.end(),
+                        std::back_inserter(unseen));
+    consider(unseen);
+    return best;
 }
 
 // like above, but find minumum over list of paths.  if names is empty, do all paths
@@ -1904,93 +2695,192 @@ int64_t XG::approx_path_distance(const string& name, int64_t id1, int64_t id2) c
 // contain the nodes when possible. 
 int64_t XG::min_approx_path_distance(const vector<string>& names,
                                      int64_t id1, int64_t id2) const {
-    vector<int64_t> min_distance(3, numeric_limits<int64_t>::max());
+    vector<size_t> allowed;
+    for (auto& name : names) {
+        size_t rank = path_rank(name);
+        if (rank) allowed.push_back(rank);
+    }
+    // none of the names exist, so there's nowhere to look
+    if (!names.empty() && allowed.empty()) return -1;
+    std::sort(allowed.begin(), allowed.end());
+    return min_path_distance(node_path_visits(id1), node_path_visits(id2), allowed);
+}
 
-    function<void(const string&)> lambda =[&](const string& name) {
-        int member1 = path_contains_node(name, id1) ? 1 : 0;
-        int member2 = path_contains_node(name, id2) ? 1 : 0;
-        int md_idx = member1 + member2;
-        
-        if (md_idx == 2 ||
-            (md_idx == 1 && min_distance[2] == numeric_limits<int64_t>::max()) ||
-            (md_idx == 0 && min_distance[2] == numeric_limits<int64_t>::max() &&
-             min_distance[1] == numeric_limits<int64_t>::max())) {
-            
-            int64_t dist = approx_path_distance(name, id1, id2);
-            if (dist >= 0 && dist < min_distance[md_idx]) {
-                min_distance[md_idx] = dist;
-            }
-        }
+vector<int64_t> XG::min_path_distances(const vector<pair<int64_t, int64_t> >& pairs,
+                                       const vector<size_t>& path_ranks) const {
+    vector<size_t> allowed;
+    for (auto rank : path_ranks) {
+        if (rank) allowed.push_back(rank);
+    }
+    std::sort(allowed.begin(), allowed.end());
+    vector<int64_t> distances(pairs.size(), -1);
+    // rank 0 is never a path, and mustn't come to mean all paths
+    if (!path_ranks.empty() && allowed.empty()) return distances;
+    // look up each node's visits only once, however many pairs it's in
+    vector<int64_t> ids;
+    ids.reserve(pairs.size() * 2);
+    for (auto& p : pairs) {
+        ids.push_back(p.first);
+        ids.push_back(p.second);
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    vector<NodePathVisits> visits(ids.size());
+#pragma omp parallel for schedule(dynamic, 256)
+    for (size_t i = 0; i < ids.size(); ++i) {
+        visits[i] = node_path_visits(ids[i]);
+    }
+    auto visits_of = [&](int64_t id) -> const NodePathVisits& {
+        return visits[std::lower_bound(ids.begin(), ids.end(), id) - ids.begin()];
     };
+#pragma omp parallel for schedule(dynamic, 256)
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        distances[i] = min_path_distance(visits_of(pairs[i].first), visits_of(pairs[i].second), allowed);
+    }
+    return distances;
+}
 
-    if (names.size() > 1) {
-        for (const string& name : names) {
-            lambda(name);
-        }
-    } else {
-        size_t max_path_rank = this->max_path_rank();
-        for (size_t i = 1; i <= max_path_rank; ++i) {
-            lambda(path_name(i));
+string XG::path_substr(const string& name, int64_t start, int64_t end, bool is_rev) const {
+    return path_substr(path_rank(name), start, end, is_rev);
+}
+
+string XG::path_substr(size_t prank, int64_t start, int64_t end, bool is_rev) const {
+    if (prank == 0) return ""; // no such path
+    auto& path = *paths[prank-1];
+    int64_t plen = path.offsets.size();
+    // clip the range to the path just as get_path_range does
+    if (start < 0) start = 0;
+    if (end < 0) end = plen-1;
+    if (start >= plen || start > end) return "";
+    if (end >= plen) end = plen-1;
+    if (is_rev) {
+        int64_t fwd_start = plen - 1 - end;
+        end = plen - 1 - start;
+        start = fwd_start;
+    }
+    string seq;
+    seq.reserve(end - start + 1);
+    for (auto step = path.steps_from(start); !step.done() && (int64_t)step->offset <= end; ++step) {
+        size_t node_begin = s_cbv_select(id_to_rank(step->id));
+        // the part of this visit inside the range, in visit coordinates
+        size_t from = max(start, (int64_t)step->offset) - step->offset;
+        size_t to = min(end + 1, (int64_t)(step->offset + step->length)) - step->offset;
+        if (!step->is_reverse) {
+            append_sequence(node_begin + from, node_begin + to, seq);
+        } else {
+            string part;
+            append_sequence(node_begin + step->length - to, node_begin + step->length - from, part);
+            seq += reverse_complement(part);
         }
     }
+    return is_rev ? reverse_complement(seq) : seq;
+}
 
-    if (min_distance[2] != numeric_limits<int64_t>::max()) {
-        return min_distance[2];
-    } else if (min_distance[1] != numeric_limits<int64_t>::max()) {
-        return min_distance[1];
-    } else if (min_distance[0] != numeric_limits<int64_t>::max()) {
-        return min_distance[0];
+void XG::write_path_fasta(ostream& out, const string& prefix, size_t line_width, size_t chunk_size) const {
+    // chunks hold whole lines, so they can be formatted independently
+    chunk_size = max(line_width, chunk_size - chunk_size % line_width);
+    size_t batch_size = omp_get_max_threads() * 4;
+    for (size_t prank = 1; prank <= max_path_rank(); ++prank) {
+        string name = path_name(prank);
+        if (name.compare(0, prefix.size(), prefix) != 0) continue;
+        out << ">" << name << "\n";
+        size_t plen = path_length(prank);
+        size_t chunk_count = (plen + chunk_size - 1) / chunk_size;
+        vector<string> formatted(batch_size);
+        for (size_t first = 0; first < chunk_count; first += batch_size) {
+            size_t last = min(chunk_count, first + batch_size);
+#pragma omp parallel for schedule(dynamic, 1)
+            for (size_t c = first; c < last; ++c) {
+                size_t start = c * chunk_size;
+                size_t end = min(plen, start + chunk_size);
+                string seq = path_substr(prank, start, end - 1);
+                string& lines = formatted[c - first];
+                lines.clear();
+                lines.reserve(seq.size() + seq.size() / line_width + 1);
+                for (size_t i = 0; i < seq.size(); i += line_width) {
+                    lines.append(seq, i, line_width);
+                    lines.push_back('\n');
+                }
+            }
+            // write the batch in order
+            for (size_t c = first; c < last; ++c) {
+                out << formatted[c - first];
+            }
+        }
     }
-    return -1;
+    out.flush();
 }
 
-void XG::get_path_range(string& name, int64_t start, int64_t stop, Graph& g, bool is_rev) const {
+void XG::get_path_range(string& name, int64_t start, int64_t stop, Graph& g, bool is_rev, bool with_edges) const {
     // what is the node at the start, and at the end
-    auto& path = *paths[path_rank(name)-1];
-    size_t plen = path.offsets.size();
-    if (start > plen) return; // no overlap with path
+    size_t prank = path_rank(name);
+    if (prank == 0) return; // no such path
+    auto& path = *paths[prank-1];
+    int64_t plen = path.offsets.size();
+    // a region without coordinates covers the whole path
+    if (start < 0) start = 0;
+    if (stop < 0) stop = plen-1;
+    if (start >= plen || start > stop) return; // no overlap with path
     // careful not to exceed the path length
     if (stop >= plen) stop = plen-1;
     if (is_rev) {
-        start = plen - start;
-        stop = plen - stop;
+        // flip the interval onto the forward strand of the path
+        int64_t fwd_start = plen - 1 - stop;
+        stop = plen - 1 - start;
+        start = fwd_start;
     }
     size_t pr1 = path.offsets_rank(start+1)-1;
     size_t pr2 = path.offsets_rank(stop+1)-1;
-    set<int64_t> nodes;
-    set<pair<side_t, side_t> > edges;
-    // Grab the IDs visited in order along the path
+    // Walk the visits along this section of path once, remembering the IDs
+    // and the span of node ranks they cover.
     auto& pi_wt = path.ids;
+    vector<int64_t> visit_ids(pr2 - pr1 + 1);
+    size_t min_rank = numeric_limits<size_t>::max();
+    size_t max_rank = 0;
     for (size_t i = pr1; i <= pr2; ++i) {
-        // For all the visits along this section of path, grab the node being visited and all its edges.
         int64_t id = pi_wt[i];
-        nodes.insert(id);
-        for (auto& e : edges_from(id)) {
-            edges.insert(make_pair(make_side(e.from(), e.from_start()), make_side(e.to(), e.to_end())));
-        }
-        for (auto& e : edges_to(id)) {
-            edges.insert(make_pair(make_side(e.from(), e.from_start()), make_side(e.to(), e.to_end())));
-        }
+        visit_ids[i-pr1] = id;
+        size_t rank = id_to_rank(id);
+        min_rank = min(min_rank, rank);
+        max_rank = max(max_rank, rank);
     }
-    for (auto& n : nodes) {
-        *g.add_node() = node(n);
+    // dedupe the nodes with a bitmap over just the ranks we touched
+    bit_vector seen(max_rank - min_rank + 1, 0);
+    for (auto id : visit_ids) {
+        seen[id_to_rank(id) - min_rank] = 1;
     }
-    map<string, Path*> local_paths;
-    for (auto& n : nodes) {
-        for (auto& m : node_mappings(n)) {
-            if (local_paths.find(m.first) == local_paths.end()) {
-                Path* p = g.add_path();
-                local_paths[m.first] = p;
-                p->set_name(m.first);
-            }
-            Path* new_path = local_paths[m.first];
-            // TODO output mapping direction
-            //if () { m.second.is_reverse(true); }
-            for (auto& n : m.second) {
-                *new_path->add_mapping() = n;
-            }
+    vector<pair<side_t, side_t> > edges;
+    for (size_t rank = min_rank; rank <= max_rank; ++rank) {
+        if (!seen[rank - min_rank]) continue;
+        int64_t id = rank_to_id(rank);
+        *g.add_node() = node(id);
+        if (!with_edges) continue;
+        // read the edges straight out of the forward and reverse tables
+        size_t f_start = f_bv_select(rank)+1;
+        size_t f_end = rank == node_count ? f_bv.size() : f_bv_select(rank+1);
+        for (size_t i = f_start; i < f_end; ++i) {
+            edges.push_back(make_pair(make_side(id, f_from_start_cbv[i]),
+                                      make_side(rank_to_id(f_iv[i]), f_to_end_cbv[i])));
+        }
+        size_t t_start = t_bv_select(rank)+1;
+        size_t t_end = rank == node_count ? t_bv.size() : t_bv_select(rank+1);
+        for (size_t i = t_start; i < t_end; ++i) {
+            edges.push_back(make_pair(make_side(rank_to_id(t_iv[i]), t_from_start_cbv[i]),
+                                      make_side(id, t_to_end_cbv[i])));
         }
     }
+    // only the mappings of the queried path that fall inside the range
+    Path* new_path = g.add_path();
+    new_path->set_name(name);
+    for (size_t i = pr1; i <= pr2; ++i) {
+        Mapping* m = new_path->add_mapping();
+        m->mutable_position()->set_node_id(visit_ids[i-pr1]);
+        m->mutable_position()->set_is_reverse(path.directions[i]);
+        m->set_rank(path.ranks[i]);
+    }
+    // an edge between two nodes in the range is seen from both of its ends
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
     for (auto& e : edges) {
         Edge edge;
         edge.set_from(side_id(e.first));
@@ -2038,16 +2928,88 @@ vector<size_t> XG::node_positions_in_path(int64_t id, size_t rank) const {
     return pos_in_path;
 }
 
-map<string, vector<size_t> > XG::node_positions_in_paths(int64_t id, bool is_rev) const {
-    map<string, vector<size_t> > positions;
-    for (auto& prank : paths_of_node(id)) {
-        auto& path = *paths[prank-1];
-        auto& pos_in_path = positions[path_name(prank)];
-        for (auto i : node_ranks_in_path(id, prank)) {
-            size_t pos = (is_rev ?
-                          path_length(prank) - path.positions[i] - node_length(id)
-                          : path.positions[i]);
-            pos_in_path.push_back(pos);
+void XG::index_node_positions(void) {
+    // count the visits to each node, so we know where its run will start
+    vector<size_t> visits(node_count+1, 0);
+    size_t total = 0;
+    for (auto path : paths) {
+        for (size_t i = 0; i < path->ids.size(); ++i) {
+            ++visits[id_to_rank(path->ids[i])];
+        }
+        total += path->ids.size();
+    }
+    vector<size_t> next(node_count+1, 0);
+    util::assign(np_bv, bit_vector(node_count + total));
+    size_t off = 0;
+    for (size_t rank = 1; rank <= node_count; ++rank) {
+        np_bv[off] = 1;
+        next[rank] = off + 1;
+        off += visits[rank] + 1;
+    }
+    // walking the paths in order leaves each run sorted by path, then offset
+    util::assign(np_iv, int_vector<>(node_count + total));
+    util::assign(np_pos_iv, int_vector<>(node_count + total));
+    for (size_t p = 0; p < paths.size(); ++p) {
+        auto& path = *paths[p];
+        for (size_t i = 0; i < path.ids.size(); ++i) {
+            size_t& slot = next[id_to_rank(path.ids[i])];
+            np_iv[slot] = p + 1;
+            np_pos_iv[slot] = path.positions[i] * 2 + path.directions[i];
+            ++slot;
+        }
+    }
+    util::bit_compress(np_iv);
+    util::bit_compress(np_pos_iv);
+    util::assign(np_bv_select, bit_vector::select_1_type(&np_bv));
+}
+
+vector<tuple<size_t, size_t, bool> > XG::node_path_positions(int64_t id) const {
+    vector<tuple<size_t, size_t, bool> > positions;
+    if (!np_bv.empty()) {
+        size_t rank = id_to_rank(id);
+        size_t end = rank == node_count ? np_bv.size() : np_bv_select(rank+1);
+        for (size_t off = np_bv_select(rank) + 1; off < end; ++off) {
+            positions.push_back(make_tuple(np_iv[off], np_pos_iv[off] / 2, np_pos_iv[off] % 2));
+        }
+        return positions;
+    }
+    vector<size_t> ranks = paths_of_node(id);
+    std::sort(ranks.begin(), ranks.end());
+    for (auto prank : ranks) {
+        auto& path = *paths[prank-1];
+        for (auto i : node_ranks_in_path(id, prank)) {
+            positions.push_back(make_tuple(prank, path.positions[i], path.directions[i]));
+        }
+    }
+    return positions;
+}
+
+map<string, vector<size_t> > XG::node_positions_in_paths(int64_t id, bool is_rev) const {
+    map<string, vector<size_t> > positions;
+    if (!np_bv.empty()) {
+        size_t length = node_length(id);
+        size_t last_rank = 0;
+        vector<size_t>* pos_in_path = nullptr;
+        for (auto& visit : node_path_positions(id)) {
+            size_t prank = get<0>(visit);
+            if (prank != last_rank) {
+                // the visits come grouped by path, so we name each path once
+                pos_in_path = &positions[path_name(prank)];
+                last_rank = prank;
+            }
+            size_t pos = get<1>(visit);
+            pos_in_path->push_back(is_rev ? path_length(prank) - pos - length : pos);
+        }
+        return positions;
+    }
+    for (auto& prank : paths_of_node(id)) {
+        auto& path = *paths[prank-1];
+        auto& pos_in_path = positions[path_name(prank)];
+        for (auto i : node_ranks_in_path(id, prank)) {
+            size_t pos = (is_rev ?
+                          path_length(prank) - path.positions[i] - node_length(id)
+                          : path.positions[i]);
+            pos_in_path.push_back(pos);
         }
     }
     return positions;
@@ -2071,6 +3033,18 @@ Mapping new_mapping(const string& name, int64_t id, size_t rank, bool is_reverse
     return m;
 }
 
+static string temp_dir_override;
+
+void set_temp_dir(const string& dir) {
+    temp_dir_override = dir;
+}
+
+string temp_dir(void) {
+    if (!temp_dir_override.empty()) return temp_dir_override;
+    const char* from_env = getenv("TMPDIR");
+    return from_env && *from_env ? from_env : "/tmp";
+}
+
 void parse_region(const string& target, string& name, int64_t& start, int64_t& end) {
     start = -1;
     end = -1;
@@ -2119,6 +3093,30 @@ int64_t XG::where_to(int64_t current_side, int64_t visit_offset, int64_t new_sid
     // Given that we were at visit_offset on the current side, where will we be
     // on the new side? 
     
+    if(!wi_prefix_iv.empty()) {
+        // Everything before us on the new side is already summed up, so we
+        // only need to find our edge in the two lists.
+        size_t in_start = wi_starts[new_side];
+        size_t in_end = wi_starts[new_side + 1];
+        size_t in_index = in_start;
+        while(in_index < in_end && wi_from_iv[in_index] != current_side) {
+            in_index++;
+        }
+        assert(in_index != in_end);
+        
+        size_t out_start = wo_starts[current_side];
+        size_t out_end = wo_starts[current_side + 1];
+        size_t out_index = out_start;
+        while(out_index < out_end && wo_to_iv[out_index] != new_side) {
+            out_index++;
+        }
+        assert(out_index != out_end);
+        
+        return wi_prefix_iv[in_index] +
+            bs_rank(current_side, visit_offset, out_index - out_start + 2) +
+            ts_iv[new_side];
+    }
+    
     // Work out where we're going as a node and orientation
     int64_t new_node_id = rank_to_id(new_side / 2);
     bool new_node_is_reverse = new_side % 2;
@@ -2236,41 +3234,75 @@ XG::thread_t XG::extract_thread(xg::XG::ThreadMapping node, int64_t offset = 0,
   while(continue_search) {
     xg::XG::ThreadMapping m = {rank_to_id(side / 2), (bool) (side % 2)};
     path.push_back(m);
-    // Work out where we go:
+    // Work out where we go, if anywhere
+    if(!thread_step(side, offset)) {
+        // Path ends here.
+        break;
+    }
+    // Continue the process from this new side
+    if(max_length != 0) {
+      if(path.size() >= max_length) {
+        continue_search = false;
+      }
+    }
+  }
+  return path;
+}
+
+bool XG::thread_step(int64_t& side, int64_t& offset) const {
     // What edge of the available edges do we take?
     int64_t edge_index = bs_get(side, offset);
+    
+    // If we find a separator, we're very broken.
     assert(edge_index != BS_SEPARATOR);
+    
     if(edge_index == BS_NULL) {
         // Path ends here.
-        break;
+        return false;
     } else {
-        // If we've got an edge, convert to an actual edge index
+        // Convert to an actual edge index
         edge_index -= 2;
     }
+    
+#ifdef VERBOSE_DEBUG
+    cerr << "Taking edge #" << edge_index << " from " << side << endl;
+#endif
+
     // We also should not have negative edges.
     assert(edge_index >= 0);
-    // Look at the edges we could have taken next
-    vector<Edge> edges_out = side % 2 ? edges_on_start(rank_to_id(side / 2)) :
-          edges_on_end(rank_to_id(side / 2));
-    assert(edge_index < edges_out.size());
-    Edge& taken = edges_out[edge_index];
-    // Follow the edge
-    int64_t other_node = taken.from() == rank_to_id(side / 2) ? taken.to() :
-          taken.from();
-    bool other_orientation = (side % 2) != taken.from_start() != taken.to_end();
-    // Get the side
-    int64_t other_side = id_to_rank(other_node) * 2 + other_orientation;
+    
+    int64_t other_side;
+    if(!wo_starts.empty()) {
+        // The sides we can go to are already laid out
+        assert(wo_starts[side] + edge_index < wo_starts[side + 1]);
+        other_side = wo_to_iv[wo_starts[side] + edge_index];
+    } else {
+        // Look at the edges we could have taken next
+        vector<Edge> edges_out = side % 2 ? edges_on_start(rank_to_id(side / 2)) : edges_on_end(rank_to_id(side / 2));
+        
+        assert(edge_index < edges_out.size());
+        
+        Edge& taken = edges_out[edge_index];
+        
+#ifdef VERBOSE_DEBUG
+        cerr << edges_out.size() << " edges possible." << endl;
+#endif
+        // Follow the edge
+        int64_t other_node = taken.from() == rank_to_id(side / 2) ? taken.to() : taken.from();
+        bool other_orientation = (side % 2) != taken.from_start() != taken.to_end();
+        
+        // Get the side 
+        other_side = id_to_rank(other_node) * 2 + other_orientation;
+    }
+    
+#ifdef VERBOSE_DEBUG
+    cerr << "Go to side " << other_side << endl;
+#endif
+    
     // Go there with where_to
     offset = where_to(side, offset, other_side);
     side = other_side;
-    // Continue the process from this new side
-    if(max_length != 0) {
-      if(path.size() >= max_length) {
-        continue_search = false;
-      }
-    }
-  }
-  return path;
+    return true;
 }
 
 void XG::insert_threads_into_dag(const vector<thread_t>& t) {
@@ -2328,40 +3360,132 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t) {
 #endif
         
     };
-
-    // We want to go through and insert running forward through the DAG, and
-    // then again backward through the DAG.
-    auto insert_in_direction = [&](bool insert_reverse) {
-
-        // First sort out the thread numbers by the node they start at.
-        // We know all the threads go the same direction through each node.
-        map<int64_t, list<size_t>> thread_numbers_by_start_node;
-        
+    
+    // The two directions and the separate components of the graph that the
+    // threads run through all touch different usage counts, start counts and
+    // B_s arrays, so they can all be inserted at once. The exception is the
+    // start counts, since a thread can start on the side where another ends,
+    // so we do those up front.
+    size_t node_ranks = max_node_rank();
+    
+    // For each direction, the threads starting at each node rank in order, at
+    // [starts_at[rank], starts_at[rank + 1]) in starting_threads.
+    vector<vector<size_t>> starts_at(2, vector<size_t>(node_ranks + 2, 0));
+    vector<vector<size_t>> starting_threads(2);
+    for(bool insert_reverse : {false, true}) {
+        auto& counts = starts_at[insert_reverse];
         for(size_t i = 0; i < t.size(); i++) {
             if(t[i].size() > 0) {
                 // Do we start with the first or last mapping in the thread?
-                size_t thread_start = insert_reverse ? t[i].size() - 1 : 0;
-                auto& mapping = t[i][thread_start];
-                thread_numbers_by_start_node[mapping.node_id].push_back(i);
+                auto& mapping = t[i][insert_reverse ? t[i].size() - 1 : 0];
+                counts[id_to_rank(mapping.node_id) + 1]++;
                 
                 // Say a thread starts here, going in the orientation determined
                 // by how the node is visited and how we're traversing the path.
                 emit_thread_start(mapping.node_id, mapping.is_reverse != insert_reverse);
             }
         }
+        for(size_t rank = 1; rank < counts.size(); rank++) {
+            counts[rank] += counts[rank - 1];
+        }
+        starting_threads[insert_reverse].resize(counts.back());
+        vector<size_t> filled(counts.begin(), counts.end() - 1);
+        for(size_t i = 0; i < t.size(); i++) {
+            if(t[i].size() > 0) {
+                auto& mapping = t[i][insert_reverse ? t[i].size() - 1 : 0];
+                starting_threads[insert_reverse][filled[id_to_rank(mapping.node_id)]++] = i;
+            }
+        }
+    }
+    
+    // Find the components the threads connect, by node rank
+    vector<size_t> component_of(node_ranks + 1);
+    iota(component_of.begin(), component_of.end(), 0);
+    auto find_root = [&](size_t rank) {
+        while(component_of[rank] != rank) {
+            component_of[rank] = component_of[component_of[rank]];
+            rank = component_of[rank];
+        }
+        return rank;
+    };
+    for(auto& thread : t) {
+        for(size_t i = 1; i < thread.size(); i++) {
+            size_t a = find_root(id_to_rank(thread[i - 1].node_id));
+            size_t b = find_root(id_to_rank(thread[i].node_id));
+            if(a != b) {
+                component_of[max(a, b)] = min(a, b);
+            }
+        }
+    }
+    // Lay out the visited node ranks of each component in rank order, at
+    // [component_starts[c], component_starts[c + 1]) in component_nodes.
+    vector<bool> visited(node_ranks + 1, false);
+    for(auto& thread : t) {
+        for(auto& mapping : thread) {
+            visited[id_to_rank(mapping.node_id)] = true;
+        }
+    }
+    vector<size_t> component_number(node_ranks + 1, numeric_limits<size_t>::max());
+    vector<size_t> component_starts = {0};
+    for(size_t rank = 1; rank <= node_ranks; rank++) {
+        size_t root = find_root(rank);
+        if(visited[rank] && component_number[root] == numeric_limits<size_t>::max()) {
+            component_number[root] = component_starts.size() - 1;
+            component_starts.push_back(0);
+        }
+    }
+    for(size_t rank = 1; rank <= node_ranks; rank++) {
+        if(visited[rank]) {
+            component_starts[component_number[find_root(rank)] + 1]++;
+        }
+    }
+    for(size_t c = 1; c < component_starts.size(); c++) {
+        component_starts[c] += component_starts[c - 1];
+    }
+    vector<size_t> component_nodes(component_starts.back());
+    {
+        vector<size_t> filled(component_starts.begin(), component_starts.end() - 1);
+        for(size_t rank = 1; rank <= node_ranks; rank++) {
+            if(visited[rank]) {
+                component_nodes[filled[component_number[find_root(rank)]]++] = rank;
+            }
+        }
+    }
+    size_t component_count = component_starts.size() - 1;
+    
+    // We have this message-passing architecture, where we send groups of
+    // threads along edges to destination nodes. Each edge rank has a queue of
+    // the threads coming in along it, and the offset in each thread that the
+    // visit to the node is at. These are messages passed along the edge from
+    // the earlier node to the later node (since we know threads follow a DAG).
+    // The queues are linked lists through an arena owned by the task sending
+    // along the edge, with heads and tails kept flat by edge rank. Only edges
+    // that threads cross carry messages, and those belong to just one
+    // component, so tasks never share a queue. Other edges can join nodes of
+    // different components, so their queues are only ever read.
+    const size_t NO_MESSAGE = numeric_limits<size_t>::max();
+    struct message_t {
+        size_t thread;
+        size_t visit;
+        size_t next;
+    };
+    size_t edge_ranks = h_iv.size() / 2 + 1;
+    vector<vector<size_t>> queue_heads(2, vector<size_t>(edge_ranks, NO_MESSAGE));
+    vector<vector<size_t>> queue_tails(2, vector<size_t>(edge_ranks, NO_MESSAGE));
+
+    // We want to go through and insert running forward through the DAG, and
+    // then again backward through the DAG.
+    auto insert_in_direction = [&](bool insert_reverse, size_t component) {
         
-        // We have this message-passing architecture, where we send groups of
-        // threads along edges to destination nodes. This records, by edge rank of
-        // the traversed edge (with 0 meaning starting there), the group of threads
-        // coming in along that edge, and the offset in each thread that the visit
-        // to the node is at. These are messages passed along the edge from the
-        // earlier node to the later node (since we know threads follow a DAG).
-        map<size_t, list<pair<size_t, size_t>>> edge_to_ordered_threads;
+        auto& heads = queue_heads[insert_reverse];
+        auto& tails = queue_tails[insert_reverse];
+        vector<message_t> arena;
         
-        for(size_t node_rank = (insert_reverse ? max_node_rank() : 1);
-            node_rank != (insert_reverse ? 0 : max_node_rank() + 1);
-            node_rank += (insert_reverse ? -1 : 1)) {
+        size_t first = component_starts[component];
+        size_t past_last = component_starts[component + 1];
+        for(size_t k = 0; k < past_last - first; k++) {
             // Then we start at the first node in the DAG
+            size_t node_rank = component_nodes[insert_reverse ? past_last - 1 - k : first + k];
             
             int64_t node_id = rank_to_id(node_rank);
             
@@ -2374,32 +3498,30 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t) {
             // We order the thread visits starting there, and then all the threads
             // coming in from other places, ordered by edge traversed.
             // Stores a pair of thread number and mapping index in the thread.
-            list<pair<size_t, size_t>> threads_visiting;
+            vector<pair<size_t, size_t>> threads_visiting;
             
-            if(thread_numbers_by_start_node.count(node_id)) {
-                // Grab the threads starting here
-                for(size_t thread_number : thread_numbers_by_start_node.at(node_id)) {
-                    // For every thread that starts here, say it visits here
-                    // with its first mapping (0 for forward inserts, last one
-                    // for reverse inserts).
-                    threads_visiting.emplace_back(thread_number, insert_reverse ? t[thread_number].size() - 1 : 0);
-                }
-                thread_numbers_by_start_node.erase(node_id);
+            for(size_t j = starts_at[insert_reverse][node_rank]; j < starts_at[insert_reverse][node_rank + 1]; j++) {
+                // For every thread that starts here, say it visits here
+                // with its first mapping (0 for forward inserts, last one
+                // for reverse inserts).
+                size_t thread_number = starting_threads[insert_reverse][j];
+                threads_visiting.emplace_back(thread_number, insert_reverse ? t[thread_number].size() - 1 : 0);
             }
             
-            
             for(Edge& in_edge : edges_of(node_id)) {
                 // Look at all the edges on the node. Messages will only exist on
                 // the incoming ones.
                 auto edge_rank = edge_rank_as_entity(in_edge);
-                if(edge_to_ordered_threads.count(edge_rank)) {
-                    // We have messages coming along this edge on our start
-                    
-                    // These threads come in next. Splice them in because they
-                    // already have the right mapping indices.
-                    threads_visiting.splice(threads_visiting.end(), edge_to_ordered_threads[edge_rank]);
-                    edge_to_ordered_threads.erase(edge_rank);
+                // These threads come in next, in the order they were sent.
+                if(heads[edge_rank] == NO_MESSAGE) {
+                    // Nothing came this way, and the edge may not be ours to
+                    // write to.
+                    continue;
+                }
+                for(size_t m = heads[edge_rank]; m != NO_MESSAGE; m = arena[m].next) {
+                    threads_visiting.emplace_back(arena[m].thread, arena[m].visit);
                 }
+                heads[edge_rank] = tails[edge_rank] = NO_MESSAGE;
             }
             
             if(threads_visiting.empty()) {
@@ -2461,7 +3583,13 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t) {
                     
                     // Send the new mapping along the edge after all the other ones
                     // we've sent along the edge
-                    edge_to_ordered_threads[next_edge_rank].push_back(next_visit);
+                    arena.push_back({next_visit.first, next_visit.second, NO_MESSAGE});
+                    if(heads[next_edge_rank] == NO_MESSAGE) {
+                        heads[next_edge_rank] = arena.size() - 1;
+                    } else {
+                        arena[tails[next_edge_rank]].next = arena.size() - 1;
+                    }
+                    tails[next_edge_rank] = arena.size() - 1;
                     
                     // Say we traverse an edge going from this node in this
                     // orientation to that node in that orientation.
@@ -2488,19 +3616,19 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t) {
             // We repeat through all nodes until done.
         }
     
-        // OK now we have gone through the whole set of everything and inserted
-        // in this direction.
+        // OK now we have gone through the whole component and inserted in
+        // this direction.
     };
     
-    // Actually call the inserts
-#ifdef VERBOSE_DEBUG
-    cerr << "Inserting threads forwards..." << endl;
-#endif
-    insert_in_direction(false);
+    // Actually call the inserts. The DYNAMIC B_s is one shared structure, so
+    // it has to be filled in one side at a time.
 #ifdef VERBOSE_DEBUG
-    cerr << "Inserting threads backwards..." << endl;
+    cerr << "Inserting threads in both directions..." << endl;
 #endif
-    insert_in_direction(true);
+#pragma omp parallel for schedule(dynamic, 1) if(bs_store->mode() == MODE_SDSL)
+    for(size_t task = 0; task < component_count * 2; task++) {
+        insert_in_direction(task % 2, task / 2);
+    }
     
     // Actually build the B_s arrays for rank and select.
 #ifdef VERBOSE_DEBUG
@@ -2511,8 +3639,157 @@ void XG::insert_threads_into_dag(const vector<thread_t>& t) {
     
 }
 
+void XG::insert_threads(const vector<thread_t>& t) {
+    
+    if(wi_starts.empty()) {
+        // We find edges through the per-side lists
+        index_thread_edges();
+    }
+    
+    // Every thread goes in forward and backward. Lay out all the visits
+    // contiguously, with each thread in [thread_starts[i], thread_starts[i+1]).
+    vector<size_t> thread_starts = {0};
+    vector<int64_t> visit_sides;
+    for(auto& thread : t) {
+        if(thread.empty()) {
+            continue;
+        }
+        for(size_t i = 0; i < thread.size(); i++) {
+            visit_sides.push_back(id_to_rank(thread[i].node_id) * 2 + thread[i].is_reverse);
+        }
+        thread_starts.push_back(visit_sides.size());
+        for(size_t i = thread.size(); i-- > 0; ) {
+            visit_sides.push_back(id_to_rank(thread[i].node_id) * 2 + !thread[i].is_reverse);
+        }
+        thread_starts.push_back(visit_sides.size());
+    }
+    size_t visit_count = visit_sides.size();
+    
+    // Which thread does each visit belong to?
+    vector<size_t> visit_threads(visit_count);
+    for(size_t i = 0; i + 1 < thread_starts.size(); i++) {
+        for(size_t v = thread_starts[i]; v < thread_starts[i + 1]; v++) {
+            visit_threads[v] = i;
+        }
+    }
+    
+    // Which incoming edge of its side did each visit arrive by? Visits that
+    // start threads come before everything else on the side, in thread order.
+    vector<size_t> in_edges(visit_count);
+#pragma omp parallel for
+    for(size_t v = 0; v < visit_count; v++) {
+        if(v == thread_starts[visit_threads[v]]) {
+            in_edges[v] = 0;
+            continue;
+        }
+        size_t in_index = wi_starts[visit_sides[v]];
+        size_t in_end = wi_starts[visit_sides[v] + 1];
+        while(in_index < in_end && wi_from_iv[in_index] != visit_sides[v - 1]) {
+            in_index++;
+        }
+        if(in_index == in_end) {
+            int64_t from = visit_sides[v - 1];
+            int64_t to = visit_sides[v];
+            cerr << "[xg] error: thread step from " << rank_to_id(from / 2) << (from % 2 ? "-" : "+")
+                 << " to " << rank_to_id(to / 2) << (to % 2 ? "-" : "+") << " follows no edge" << endl;
+            exit(1);
+        }
+        in_edges[v] = in_index - wi_starts[visit_sides[v]] + 1;
+    }
+    
+    // A visit's place on its side is set by its side, the edge it came in
+    // by, and then the place of the visit before it, all the way back to the
+    // start of its thread. Rank visits by longer and longer prefixes of that
+    // until every visit has its own rank.
+    vector<size_t> order(visit_count);
+    iota(order.begin(), order.end(), 0);
+    vector<size_t> ranks(visit_count);
+    vector<size_t> earlier_ranks(visit_count);
+    
+    // Assign dense ranks to visits in order, with ties where key says so.
+    // Returns the number of distinct ranks.
+    auto rerank = [&](const function<bool(size_t, size_t)>& same) {
+        vector<size_t> new_ranks(visit_count);
+        size_t rank = 0;
+        for(size_t i = 0; i < visit_count; i++) {
+            if(i == 0 || !same(order[i - 1], order[i])) {
+                rank++;
+            }
+            new_ranks[order[i]] = rank;
+        }
+        ranks.swap(new_ranks);
+        return rank;
+    };
+    
+    // First rank by one step: side, then starts by thread, then edge.
+    auto first_key = [&](size_t v) {
+        bool starts = v == thread_starts[visit_threads[v]];
+        return make_tuple(visit_sides[v], in_edges[v], starts ? visit_threads[v] : 0);
+    };
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return first_key(a) < first_key(b);
+        });
+    size_t distinct = rerank([&](size_t a, size_t b) { return first_key(a) == first_key(b); });
+    
+    for(size_t h = 1; distinct < visit_count; h *= 2) {
+        // Look h visits back, where 0 means the thread started less than h
+        // visits ago and so this visit is already uniquely ranked.
+#pragma omp parallel for
+        for(size_t v = 0; v < visit_count; v++) {
+            size_t start = thread_starts[visit_threads[v]];
+            earlier_ranks[v] = v - start >= h ? ranks[v - h] : 0;
+        }
+        auto key = [&](size_t v) {
+            return make_pair(ranks[v], earlier_ranks[v]);
+        };
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return key(a) < key(b);
+            });
+        distinct = rerank([&](size_t a, size_t b) { return key(a) == key(b); });
+    }
+    
+    // Now the visits are in order within each side, and sides are in order.
+    // Fill in each side's B_s array and the usage counts from that.
+    for(size_t i = 0; i < visit_count; ) {
+        int64_t side = visit_sides[order[i]];
+        vector<destination_t> destinations;
+        for(; i < visit_count && visit_sides[order[i]] == side; i++) {
+            size_t v = order[i];
+            size_t thread = visit_threads[v];
+            if(v == thread_starts[thread]) {
+                ts_iv[side]++;
+            }
+            if(v + 1 == thread_starts[thread + 1]) {
+                // The thread ends here
+                destinations.push_back(BS_NULL);
+                continue;
+            }
+            
+            // Which of our outgoing edges goes to the next visit?
+            int64_t next_side = visit_sides[v + 1];
+            size_t out_index = wo_starts[side];
+            while(wo_to_iv[out_index] != next_side) {
+                out_index++;
+            }
+            destinations.push_back(out_index - wo_starts[side] + 2);
+            
+            // Count the edge in the direction the thread crosses it. The
+            // next visit arrives by it.
+            h_iv[wi_slot_iv[wi_starts[next_side] + in_edges[v + 1] - 1]]++;
+        }
+        
+        // Count the visits to the node in this orientation
+        h_iv[(node_rank_as_entity(rank_to_id(side / 2)) - 1) * 2 + side % 2] = destinations.size();
+        bs_set(side, destinations);
+    }
+    
+    bs_bake();
+}
+
 void XG::insert_thread(const thread_t& t) {
-    // We're going to insert this thread
+    // We're going to insert this thread, which changes the usage counts that
+    // the incoming edge prefix sums were made from.
+    util::clear(wi_prefix_iv);
     
     auto insert_thread_forward = [&](const thread_t& thread) {
     
@@ -2738,67 +4015,16 @@ auto XG::extract_threads() const -> list<thread_t> {
             int64_t side = i;
             int64_t offset = j;
             
-            while(true) {
-                
-                // Unpack the side into a node traversal
+            do {
+                // Unpack the side into a node traversal and add it
                 ThreadMapping m = {rank_to_id(side / 2), (bool) (side % 2)};
-                
-                // Add the mapping to the thread
                 path.push_back(m);
                 
 #ifdef VERBOSE_DEBUG
                 cerr << "At side " << side << endl;
-                
 #endif
-                // Work out where we go
-                
-                // What edge of the available edges do we take?
-                int64_t edge_index = bs_get(side, offset);
-                
-                // If we find a separator, we're very broken.
-                assert(edge_index != BS_SEPARATOR);
-                
-                if(edge_index == BS_NULL) {
-                    // Path ends here.
-                    break;
-                } else {
-                    // Convert to an actual edge index
-                    edge_index -= 2;
-                }
-                
-#ifdef VERBOSE_DEBUG
-                cerr << "Taking edge #" << edge_index << " from " << side << endl;
-#endif
-
-                // We also should not have negative edges.
-                assert(edge_index >= 0);
-                
-                // Look at the edges we could have taken next
-                vector<Edge> edges_out = side % 2 ? edges_on_start(rank_to_id(side / 2)) : edges_on_end(rank_to_id(side / 2));
-                
-                assert(edge_index < edges_out.size());
-                
-                Edge& taken = edges_out[edge_index];
                 
-#ifdef VERBOSE_DEBUG
-                cerr << edges_out.size() << " edges possible." << endl;
-#endif
-                // Follow the edge
-                int64_t other_node = taken.from() == rank_to_id(side / 2) ? taken.to() : taken.from();
-                bool other_orientation = (side % 2) != taken.from_start() != taken.to_end();
-                
-                // Get the side 
-                int64_t other_side = id_to_rank(other_node) * 2 + other_orientation;
-                
-#ifdef VERBOSE_DEBUG
-                cerr << "Go to side " << other_side << endl;
-#endif
-                
-                // Go there with where_to
-                offset = where_to(side, offset, other_side);
-                side = other_side;
-    
-            }
+            } while(thread_step(side, offset));
             
             found.push_back(path);
             
@@ -2808,227 +4034,661 @@ auto XG::extract_threads() const -> list<thread_t> {
     return found;
 }
 
-XG::destination_t XG::bs_get(int64_t side, int64_t offset) const {
-#if GPBWT_MODE == MODE_SDSL
-    if(!bs_arrays.empty()) {
-        // We still have per-side arrays
-        return bs_arrays.at(side - 2)[offset];
-    } else {
-        // We have a single big array
-#ifdef VERBOSE_DEBUG
-        cerr << "Range " << side << " has its separator at " << bs_single_array.select(side, BS_SEPARATOR) << endl;
-        cerr << "Offset " << offset << " puts us at " << bs_single_array.select(side, BS_SEPARATOR) + 1 + offset << endl;
-#endif
-        return bs_single_array[bs_single_array.select(side, BS_SEPARATOR) + 1 + offset];
+void XG::for_each_thread(const function<void(size_t, const thread_t&)>& lambda) const {
+    // Number the thread starts in the order extract_threads finds them
+    vector<size_t> starts_before(ts_iv.size() + 1, 0);
+    for(size_t i = 0; i < ts_iv.size(); i++) {
+        starts_before[i + 1] = starts_before[i] + ts_iv[i];
     }
-#elif GPBWT_MODE == MODE_DYNAMIC
-    // Start after the separator for the side and go offset from there.
-    
-    auto& bs_single_array = const_cast<rank_select_int_vector&>(this->bs_single_array);
+    size_t thread_count = starts_before.back();
     
-    return bs_single_array.at(bs_single_array.select(side - 2, BS_SEPARATOR) + 1 + offset);
-#endif
-    
-}
-
-size_t XG::bs_rank(int64_t side, int64_t offset, destination_t value) const {
-#if GPBWT_MODE == MODE_SDSL
-    if(!bs_arrays.empty()) {
-        throw runtime_error("No rank support until bs_bake() is called!");
-    } else {
-        size_t range_start = bs_single_array.select(side, BS_SEPARATOR) + 1;
-        return bs_single_array.rank(range_start + offset, value) - bs_single_array.rank(range_start, value);
+#pragma omp parallel for schedule(dynamic, 1)
+    for(size_t number = 0; number < thread_count; number++) {
+        // Find the side this thread starts on, and where among its starts
+        size_t i = std::upper_bound(starts_before.begin(), starts_before.end(), number) - starts_before.begin() - 1;
+        int64_t side = i;
+        int64_t offset = number - starts_before[i];
+        
+        thread_t path;
+        do {
+            ThreadMapping m = {rank_to_id(side / 2), (bool) (side % 2)};
+            path.push_back(m);
+        } while(thread_step(side, offset));
+        
+        lambda(number, path);
     }
-#elif GPBWT_MODE == MODE_DYNAMIC
-
-    auto& bs_single_array = const_cast<rank_select_int_vector&>(this->bs_single_array);
+}
 
-    // Where does the B_s[] range for the side we're interested in start?
-    int64_t bs_start = bs_single_array.select(side - 2, BS_SEPARATOR) + 1;
-    
-    // Get the rank difference between the start and the start plus the offset.
-    return bs_single_array.rank(bs_start + offset, value) - bs_single_array.rank(bs_start, value);
-#endif
+int XG::gpbwt_mode(void) const {
+    return bs_store ? bs_store->mode() : GPBWT_MODE;
 }
 
-void XG::bs_set(int64_t side, vector<destination_t> new_array) {
-#if GPBWT_MODE == MODE_SDSL
-    // We always know bs_arrays will be big enough.
-    
-    // Turn the new array into a string of bytes.
-    // TODO: none of the destinations can be 255 or greater!
-    bs_arrays.at(side - 2) = string(new_array.size(), 0);
-    copy(new_array.begin(), new_array.end(), bs_arrays.at(side - 2).begin());
-    
-#ifdef VERBOSE_DEBUG
-    cerr << "B_s for " << side << ": ";
-    for(auto entry : bs_arrays.at(side - 2)) { 
-        cerr << to_string(entry);
-    }
-    cerr << endl;
-#endif
-#elif GPBWT_MODE == MODE_DYNAMIC
-    auto current_separators = bs_single_array.rank(bs_single_array.size(), BS_SEPARATOR);
-    while(current_separators <= side - 2) {
-        // Tack on separators until we have enough
-        bs_single_array.insert(bs_single_array.size(), BS_SEPARATOR);
-        current_separators++;
+void XG::add_threads(const vector<thread_t>& t) {
+    // Check the whole batch first, so a bad thread can't leave B_s half done
+    for(size_t i = 0; i < t.size(); i++) {
+        auto& thread = t[i];
+        for(size_t j = 0; j < thread.size(); j++) {
+            if(!has_node(thread[j].node_id)) {
+                cerr << "[xg] error: step " << j << " of thread " << i << " is on node "
+                     << thread[j].node_id << ", which is not in the graph" << endl;
+                exit(1);
+            }
+            if(j > 0 && !has_edge(make_edge(thread[j - 1].node_id, thread[j - 1].is_reverse,
+                                            thread[j].node_id, thread[j].is_reverse))) {
+                cerr << "[xg] error: steps " << j - 1 << " and " << j << " of thread " << i
+                     << " are not joined by an edge in the graph" << endl;
+                exit(1);
+            }
+        }
     }
-
-    // Where does the block we want start?
-    size_t this_range_start = bs_single_array.select(side - 2, BS_SEPARATOR) + 1;
     
-    // Where is the first spot not in the range for this side?
-    int64_t this_range_past_end = (side - 2 == bs_single_array.rank(bs_single_array.size(), BS_SEPARATOR) - 1 ?
-        bs_single_array.size() : bs_single_array.select(side - 2 + 1, BS_SEPARATOR));
-    
-    if(this_range_start != this_range_past_end) {
-        // We can't overwrite! Just explode.
-        throw runtime_error("B_s overwrite not supported");
+    if(wi_starts.empty()) {
+        // The index was built without threads, so there's no B_s to add to
+        // yet. Start it from scratch.
+        index_thread_edges();
+        bs_store = BsStore::make(gpbwt_mode(), max_node_rank() * 2);
     }
     
-    size_t bs_insert_index = this_range_start;
+    for(auto& thread : t) {
+        insert_thread(thread);
+    }
     
-    for(auto destination : new_array) {
-        // Blit everything into the B_s array
-        bs_single_array.insert(bs_insert_index, destination);
-        bs_insert_index++;
+    if(bs_store->wants_compaction()) {
+        // Fold the batch in once, rather than as it went
+        bs_store->compact();
     }
-#endif
+    
+    // The usage counts are final for now
+    index_thread_edge_prefixes();
+}
+
+XG::destination_t XG::bs_get(int64_t side, int64_t offset) const {
+    return bs_store->get(side, offset);
+}
+
+size_t XG::bs_rank(int64_t side, int64_t offset, destination_t value) const {
+    return bs_store->rank(side, offset, value);
+}
+
+void XG::bs_set(int64_t side, vector<destination_t> new_array) {
+    bs_store->set(side, new_array);
 }
 
 void XG::bs_insert(int64_t side, int64_t offset, destination_t value) {
-#if GPBWT_MODE == MODE_SDSL
-    // This is a pretty slow insert. Use set instead.
+    bs_store->insert(side, offset, value);
+}
 
-    auto& array_to_expand = bs_arrays.at(side - 2);
+void XG::bs_bake() {
+    bs_store->bake();
     
-    // Stick one copy of the new entry in at the right position.
-    array_to_expand.insert(offset, 1, value);
-#elif GPBWT_MODE == MODE_DYNAMIC
-     // Find the place to put it in the correct side's B_s and insert
-     bs_single_array.insert(bs_single_array.select(side - 2, BS_SEPARATOR) + 1 + offset, value);
-#endif
+    // No more inserts, so the usage counts are final
+    index_thread_edge_prefixes();
 }
 
-void XG::bs_bake() {
-#if GPBWT_MODE == MODE_SDSL
-    // First pass: determine required size
-    size_t total_visits = 1;
-    for(auto& bs_array : bs_arrays) {
-        total_visits += 1; // For the separator
-        total_visits += bs_array.size();
+// Dump one B_s entry the way bs_dump does.
+static void dump_bs_entry(ostream& out, size_t entry) {
+    if(entry == BsStore::SEPARATOR) {
+        /// Mark separators
+        out << "---SEP---" << endl;
+    } else if(entry == BsStore::NULL_DESTINATION) {
+        // Mark nulls
+        out << "**NULL**" << endl;
+    } else {
+        // Output adjusted, actual edge numbers
+        out << entry - 2 << endl;
     }
+}
 
-#ifdef VERBOSE_DEBUG
-    cerr << "Allocating giant B_s array of " << total_visits << " bytes..." << endl;
-#endif
-    // Move over to a single array which is big enough to start out with.
-    string all_bs_arrays(total_visits, 0);
+// Count the entries equal to value in an unbaked B_s array before offset.
+static size_t count_bs_entries(const int_vector<>& array, int64_t offset, size_t value) {
+    return std::count(array.begin(), array.begin() + offset, value);
+}
+
+// Insert into an unbaked B_s array, widening it only if the new entry needs it.
+static void insert_bs_entry(int_vector<>& array, int64_t offset, size_t value) {
+    uint8_t needed = value ? bits::hi(value) + 1 : 1;
+    if(needed > array.width()) {
+        int_vector<> wider(array.size(), 0, needed);
+        copy(array.begin(), array.end(), wider.begin());
+        array.swap(wider);
+    }
+    array.resize(array.size() + 1);
+    for(size_t i = array.size() - 1; i > (size_t) offset; i--) {
+        array[i] = array[i - 1];
+    }
+    array[offset] = value;
+}
+
+// Keeps B_s as per-side arrays while threads go in, and then bakes them into
+// one static run-length-compressed wavelet tree for querying. Inserts after
+// baking are kept apart, as just the inserted entries for each side, and
+// answered by merging them with the baked range until the next bake.
+class SdslBsStore : public BsStore {
+public:
+    // We keep our strings in instances of this cool run-length-compressed
+    // wavelet tree. The run heads go in a Huffman-shaped tree over integers,
+    // so sides can have any number of edges while the common few-edge sides
+    // still get short codes.
+    using rank_select_int_vector = sdsl::wt_rlmn<sdsl::sd_vector<>,
+                                                 sdsl::sd_vector<>::rank_1_type,
+                                                 sdsl::sd_vector<>::select_1_type,
+                                                 sdsl::wt_huff_int<>>;
     
-    // Where are we writing to?
-    size_t pos = 0;
+    // We have one B_s array for every side, but the first 2 numbers for sides
+    // are unused. But max node rank is inclusive, so it evens out...
+    SdslBsStore(size_t side_count) : bs_arrays(side_count), baked_sides(0), delta_entries(0) { }
     
-    // Start with a separator for sides 0 and 1.
-    // We don't start at run 0 because we can't select(0, BS_SEPARATOR).
-    all_bs_arrays[pos++] = BS_SEPARATOR;
+    int mode(void) const { return MODE_SDSL; }
     
+    size_t get(int64_t side, int64_t offset) const {
+        if(!bs_arrays.empty()) {
+            // We still have per-side arrays
+            return bs_arrays.at(side - 2)[offset];
+        }
+        auto found = delta.find(side);
+        if(found != delta.end()) {
+            // This side has been inserted into since baking. The entry is
+            // either one of the inserted ones, or the baked one we get to by
+            // skipping those before it.
+            auto& inserted = found->second;
+            auto here = first_inserted_at(inserted, offset);
+            if(here != inserted.end() && here->first == (size_t) offset) {
+                return here->second;
+            }
+            return bs_single_array[bs_starts_select(side - 1) + offset - (here - inserted.begin())];
+        } else {
+            // We have a single big array
 #ifdef VERBOSE_DEBUG
-    cerr << "Baking " << bs_arrays.size() << " sides' arrays..." << endl;
+            cerr << "Range " << side << " starts at " << bs_starts_select(side - 1) << endl;
+            cerr << "Offset " << offset << " puts us at " << bs_starts_select(side - 1) + offset << endl;
 #endif
+            return bs_single_array[bs_starts_select(side - 1) + offset];
+        }
+    }
     
-    for(auto& bs_array : bs_arrays) {
-        // Stick everything together with a separator at the front of every
-        // range.
-        all_bs_arrays[pos++] = BS_SEPARATOR;
-        for(size_t i = 0; i < bs_array.size(); i++) {
-            all_bs_arrays[pos++] = bs_array[i];
+    size_t rank(int64_t side, int64_t offset, size_t value) const {
+        if(!bs_arrays.empty()) {
+            // No rank support yet, so scan
+            return count_bs_entries(bs_arrays.at(side - 2), offset, value);
+        }
+        size_t range_start = bs_starts_select(side - 1);
+        auto found = delta.find(side);
+        if(found != delta.end()) {
+            // Count the baked entries before the ones inserted before offset,
+            // and then those inserted entries themselves.
+            auto& inserted = found->second;
+            auto here = first_inserted_at(inserted, offset);
+            size_t baked_offset = offset - (here - inserted.begin());
+            size_t count = bs_single_array.rank(range_start + baked_offset, value) - bs_single_array.rank(range_start, value);
+            for(auto it = inserted.begin(); it != here; ++it) {
+                count += it->second == value;
+            }
+            return count;
+        } else {
+            return bs_single_array.rank(range_start + offset, value) - bs_single_array.rank(range_start, value);
         }
-        bs_array.clear();
     }
     
+    void set(int64_t side, const vector<size_t>& new_array) {
+        // We always know bs_arrays will be big enough.
+        
+        // Pack the new array as narrow as its biggest destination allows.
+        auto& array_to_set = bs_arrays.at(side - 2);
+        util::assign(array_to_set, int_vector<>(new_array.size()));
+        copy(new_array.begin(), new_array.end(), array_to_set.begin());
+        util::bit_compress(array_to_set);
+        
 #ifdef VERBOSE_DEBUG
-    cerr << "B_s: ";
-    for(auto entry : all_bs_arrays) { 
-        cerr << to_string(entry);
-    }
-    cerr << endl;
+        cerr << "B_s for " << side << ": ";
+        for(auto entry : bs_arrays.at(side - 2)) { 
+            cerr << to_string(entry);
+        }
+        cerr << endl;
 #endif
+    }
     
-    // Rebuild based on the entire concatenated string.
-    construct_im(bs_single_array, all_bs_arrays, 1);
+    void insert(int64_t side, int64_t offset, size_t value) {
+        // This is a pretty slow insert. Use set instead.
+        
+        if(!bs_arrays.empty()) {
+            insert_bs_entry(bs_arrays.at(side - 2), offset, value);
+            return;
+        }
+        
+        // We're baked, so remember just the new entry, at its place in the
+        // merged side. Everything inserted after it moves along one.
+        auto& inserted = delta[side];
+        auto here = first_inserted_at(inserted, offset);
+        for(auto it = here; it != inserted.end(); ++it) {
+            it->first++;
+        }
+        inserted.insert(here, make_pair((size_t) offset, value));
+        delta_entries++;
+    }
+    
+    bool wants_compaction(void) const {
+        // Merging gets slow once the inserts are big next to the baked array.
+        return delta_entries > max(bs_single_array.size() / DELTA_FRACTION, MIN_DELTA_ENTRIES);
+    }
     
-    bs_arrays.clear();
+    void bake(void) {
+        if(bs_arrays.empty() && baked_sides > 0) {
+            // We're baking again, so get every side back out, with its
+            // inserts merged in.
+            vector<int_vector<>> unpacked(baked_sides);
+            for(size_t i = 0; i < baked_sides; i++) {
+                unpacked[i] = unpack_side(i + 2);
+            }
+            map<int64_t, inserts_t>().swap(delta);
+            delta_entries = 0;
+            bs_arrays.swap(unpacked);
+        }
+        
+        // First pass: determine required size
+        size_t total_visits = 1;
+        // Separators take 1 bit, and then we need as many as the widest side
+        uint8_t width = 1;
+        for(auto& bs_array : bs_arrays) {
+            total_visits += 1; // For the separator
+            total_visits += bs_array.size();
+            width = max(width, bs_array.width());
+        }
+        
+#ifdef VERBOSE_DEBUG
+        cerr << "Streaming B_s array of " << total_visits << " " << (int) width << "-bit entries..." << endl;
 #endif
-}
-
-void XG::bs_dump(ostream& out) const {
-#if GPBWT_MODE == MODE_SDSL
-    if(!bs_arrays.empty()) {
-        // We still have per-side arrays
+        // Stream everything out to disk as one array, dropping each side's own
+        // array once it's written, so we never hold the B_s data twice over.
+        // The file goes whatever way we leave, after the buffer lets go of it.
+        struct remove_on_exit {
+            string file;
+            ~remove_on_exit(void) { sdsl::remove(file); }
+        } bs_file_guard = {tmp_file(cache_config(true, temp_dir()), "_bs")};
+        const string& bs_file = bs_file_guard.file;
+        int_vector_buffer<> all_bs_arrays(bs_file, std::ios::out, 1024*1024, width);
         
-        for(auto& array : bs_arrays) {
-            // For each side in order
-            out << "---SEP---" << endl;
-            for(auto& entry : array) {
-                if(entry == BS_NULL) {
-                    // Mark nulls
-                    out << "**NULL**" << endl;
-                } else {
-                    // Output adjusted, actual edge numbers
-                    out << entry - 2 << endl;
-                }
+        // Where are we writing to?
+        size_t pos = 0;
+        
+        // Where does each side's range start? One past the end is a valid start
+        // if the last range is empty.
+        bit_vector range_starts(total_visits + 1, 0);
+        
+        // Start with a separator for sides 0 and 1.
+        // We don't start at run 0 because we can't select(0, BS_SEPARATOR).
+        all_bs_arrays.push_back(SEPARATOR);
+        pos++;
+        
+#ifdef VERBOSE_DEBUG
+        cerr << "Baking " << bs_arrays.size() << " sides' arrays..." << endl;
+#endif
+        
+        for(auto& bs_array : bs_arrays) {
+            // Stick everything together with a separator at the front of every
+            // range.
+            all_bs_arrays.push_back(SEPARATOR);
+            pos++;
+            range_starts[pos] = 1;
+            for(size_t i = 0; i < bs_array.size(); i++) {
+                all_bs_arrays.push_back(bs_array[i]);
             }
+            pos += bs_array.size();
+            util::clear(bs_array);
         }
-    } else {
-        // We have a single big array
+        all_bs_arrays.close();
         
-        for(size_t i = 0; i < bs_single_array.size(); i++) {
-            auto entry = bs_single_array[i];
-            if(entry == BS_SEPARATOR) {
-                /// Mark separators
+        // Build the wavelet tree by reading the array back in.
+        construct(bs_single_array, bs_file, 0);
+        
+        util::assign(bs_starts, sd_vector<>(range_starts));
+        util::assign(bs_starts_select, sd_vector<>::select_1_type(&bs_starts));
+        
+        baked_sides = bs_arrays.size();
+        vector<int_vector<>>().swap(bs_arrays);
+    }
+    
+    void compact(void) {
+        // Sides that never got any entries, as when the index has no threads,
+        // aren't worth a wavelet tree.
+        bool unbaked_entries = false;
+        for(auto& bs_array : bs_arrays) {
+            unbaked_entries = unbaked_entries || !bs_array.empty();
+        }
+        if(unbaked_entries || !delta.empty()) {
+            bake();
+        }
+    }
+    
+    void dump(ostream& out) const {
+        if(!bs_arrays.empty()) {
+            // We still have per-side arrays
+            
+            for(auto& array : bs_arrays) {
+                // For each side in order
+                out << "---SEP---" << endl;
+                for(auto entry : array) {
+                    dump_bs_entry(out, entry);
+                }
+            }
+        } else if(!delta.empty()) {
+            // Some sides have been inserted into since baking, so go side by
+            // side.
+            out << "---SEP---" << endl;
+            for(int64_t side = 2; side < (int64_t) baked_sides + 2; side++) {
                 out << "---SEP---" << endl;
-            } else if(entry == BS_NULL) {
-                // Mark nulls
-                out << "**NULL**" << endl;
+                auto found = delta.find(side);
+                size_t side_size = side_end(side) - bs_starts_select(side - 1) + (found != delta.end() ? found->second.size() : 0);
+                for(size_t i = 0; i < side_size; i++) {
+                    dump_bs_entry(out, get(side, i));
+                }
+            }
+        } else {
+            // We have a single big array
+            
+            for(size_t i = 0; i < bs_single_array.size(); i++) {
+                dump_bs_entry(out, bs_single_array[i]);
+            }
+            
+            // Now dump the wavelet tree to a string
+            stringstream wt_dump;
+            bs_single_array.serialize(wt_dump, nullptr, "");
+            
+            out << endl << "++++Serialized Bits++++" << endl;
+            
+            // Turn all the bytes into binary representations
+            for(auto& letter : wt_dump.str()) {
+                // Make each into a bitset
+                bitset<8> bits(letter);
+                out << bits << endl;
+            }
+            
+        }
+    }
+    
+    void load(istream& in) {
+        vector<int_vector<>>().swap(bs_arrays);
+        map<int64_t, inserts_t>().swap(delta);
+        delta_entries = 0;
+        bs_single_array.load(in);
+        bs_starts.load(in);
+        bs_starts_select.load(in, &bs_starts);
+        // Every side has a range start, so count them
+        baked_sides = bs_starts.size() > 0 ? sd_vector<>::rank_1_type(&bs_starts)(bs_starts.size()) : 0;
+    }
+    
+    size_t serialize(ostream& out, sdsl::structure_tree_node* s, std::string name) const {
+        // Baking, or compacting after inserts, required before serialization.
+        sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(s, name, sdsl::util::class_name(*this));
+        size_t written = 0;
+        written += bs_single_array.serialize(out, child, "bs_single_array");
+        written += bs_starts.serialize(out, child, "bs_range_starts");
+        written += bs_starts_select.serialize(out, child, "bs_range_starts_select");
+        sdsl::structure_tree::add_size(child, written);
+        return written;
+    }
+    
+private:
+    // Where does the baked range for a side end? Each range but the last ends
+    // at the separator in front of the next one.
+    size_t side_end(int64_t side) const {
+        return side - 1 < (int64_t) baked_sides ? bs_starts_select(side) - 1 : bs_single_array.size();
+    }
+    
+    // The entries inserted into a side since baking, as their offsets in the
+    // merged side and their values, sorted by offset.
+    using inserts_t = vector<pair<size_t, size_t>>;
+    
+    // Find the first inserted entry at or after offset in the merged side.
+    static inserts_t::const_iterator first_inserted_at(const inserts_t& inserted, int64_t offset) {
+        return std::lower_bound(inserted.begin(), inserted.end(), (size_t) offset,
+                                [](const pair<size_t, size_t>& entry, size_t o) { return entry.first < o; });
+    }
+    static inserts_t::iterator first_inserted_at(inserts_t& inserted, int64_t offset) {
+        return std::lower_bound(inserted.begin(), inserted.end(), (size_t) offset,
+                                [](const pair<size_t, size_t>& entry, size_t o) { return entry.first < o; });
+    }
+    
+    // Copy a side's range out of the baked wavelet tree, with its inserts.
+    int_vector<> unpack_side(int64_t side) const {
+        size_t range_start = bs_starts_select(side - 1);
+        size_t baked_size = side_end(side) - range_start;
+        auto found = delta.find(side);
+        size_t inserted_size = found != delta.end() ? found->second.size() : 0;
+        int_vector<> unpacked(baked_size + inserted_size);
+        size_t baked = 0;
+        size_t next_insert = 0;
+        for(size_t i = 0; i < unpacked.size(); i++) {
+            if(next_insert < inserted_size && found->second[next_insert].first == i) {
+                unpacked[i] = found->second[next_insert++].second;
             } else {
-                // Output adjusted, actual edge numbers
-                out << entry - 2 << endl;
+                unpacked[i] = bs_single_array[range_start + baked++];
             }
         }
+        util::bit_compress(unpacked);
+        return unpacked;
+    }
+    
+    // The inserts may add up to this fraction of the baked entries, or
+    // MIN_DELTA_ENTRIES if that's more, before we want to bake again.
+    static const size_t DELTA_FRACTION = 8;
+    static const size_t MIN_DELTA_ENTRIES = 1 << 20;
+    
+    // We use this for creating the sub-parts of the uncompressed B_s arrays.
+    // We don't really support rank and select on this.
+    vector<int_vector<>> bs_arrays;
+    
+    // How many sides went into the baked array.
+    size_t baked_sides;
+    
+    // The entries inserted since the last bake, by side, to be merged with
+    // the baked ranges.
+    map<int64_t, inserts_t> delta;
+    // Total entries inserted since the last bake, to know when to bake again.
+    size_t delta_entries;
+    
+    // This holds the concatenated Benedict arrays, with SEPARATOR separating
+    // them, and NULL_DESTINATION noting the null side (i.e. the thread ends
+    // at this node).
+    rank_select_int_vector bs_single_array;
+    
+    // Marks where each side's range starts in the baked bs_single_array, so
+    // finding it is a select on this instead of on the wavelet tree. The range
+    // for side s starts at bs_starts_select(s - 1).
+    sd_vector<> bs_starts;
+    sd_vector<>::select_1_type bs_starts_select;
+};
+
+const size_t SdslBsStore::DELTA_FRACTION;
+const size_t SdslBsStore::MIN_DELTA_ENTRIES;
+
+// Keeps B_s in one dynamic run-length-compressed string, which can be inserted
+// into at any time. Each side's range starts after its own separator, with the
+// range for side 2 first.
+class DynamicBsStore : public BsStore {
+public:
+    using rank_select_int_vector = dyn::rle_str;
+    
+    // Lay down all the separators up front, so inserts find their sides.
+    DynamicBsStore(size_t side_count) {
+        for(size_t i = 0; i < side_count; i++) {
+            bs_single_array.insert(bs_single_array.size(), SEPARATOR);
+        }
+    }
+    
+    int mode(void) const { return MODE_DYNAMIC; }
+    
+    size_t get(int64_t side, int64_t offset) const {
+        // Start after the separator for the side and go offset from there.
+        return bs_single_array.at(bs_single_array.select(side - 2, SEPARATOR) + 1 + offset);
+    }
+    
+    size_t rank(int64_t side, int64_t offset, size_t value) const {
+        // Where does the B_s[] range for the side we're interested in start?
+        int64_t bs_start = bs_single_array.select(side - 2, SEPARATOR) + 1;
+        
+        // Get the rank difference between the start and the start plus the offset.
+        return bs_single_array.rank(bs_start + offset, value) - bs_single_array.rank(bs_start, value);
+    }
+    
+    void set(int64_t side, const vector<size_t>& new_array) {
+        auto current_separators = bs_single_array.rank(bs_single_array.size(), SEPARATOR);
+        while(current_separators <= side - 2) {
+            // Tack on separators until we have enough
+            bs_single_array.insert(bs_single_array.size(), SEPARATOR);
+            current_separators++;
+        }
         
-        // Now dump the wavelet tree to a string
-        stringstream wt_dump;
-        bs_single_array.serialize(wt_dump, nullptr, "");
+        // Where does the block we want start?
+        size_t this_range_start = bs_single_array.select(side - 2, SEPARATOR) + 1;
         
-        out << endl << "++++Serialized Bits++++" << endl;
+        // Where is the first spot not in the range for this side?
+        int64_t this_range_past_end = (side - 2 == bs_single_array.rank(bs_single_array.size(), SEPARATOR) - 1 ?
+            bs_single_array.size() : bs_single_array.select(side - 2 + 1, SEPARATOR));
         
-        // Turn all the bytes into binary representations
-        for(auto& letter : wt_dump.str()) {
-            // Make each into a bitset
-            bitset<8> bits(letter);
-            out << bits << endl;
+        if(this_range_start != this_range_past_end) {
+            // We can't overwrite! Just explode.
+            throw runtime_error("B_s overwrite not supported");
         }
         
+        size_t bs_insert_index = this_range_start;
+        
+        for(auto destination : new_array) {
+            // Blit everything into the B_s array
+            bs_single_array.insert(bs_insert_index, destination);
+            bs_insert_index++;
+        }
     }
-#elif GPBWT_MODE == MODE_DYNAMIC
-    auto& bs_single_array = const_cast<rank_select_int_vector&>(this->bs_single_array);
     
-    for(size_t i = 0; i < bs_single_array.size(); i++) {
-        auto entry = bs_single_array.at(i);
-        if(entry == BS_SEPARATOR) {
-            /// Mark separators
-            out << "---SEP---" << endl;
-        } else if(entry == BS_NULL) {
-            // Mark nulls
-            out << "**NULL**" << endl;
-        } else {
-            // Output adjusted, actual edge numbers
-            out << entry - 2 << endl;
+    void insert(int64_t side, int64_t offset, size_t value) {
+        // Find the place to put it in the correct side's B_s and insert
+        bs_single_array.insert(bs_single_array.select(side - 2, SEPARATOR) + 1 + offset, value);
+    }
+    
+    void bake(void) {
+        // Always ready for queries
+    }
+    
+    void dump(ostream& out) const {
+        for(size_t i = 0; i < bs_single_array.size(); i++) {
+            dump_bs_entry(out, bs_single_array.at(i));
         }
     }
-#endif
     
+    void load(istream& in) {
+        // The DYNAMIC code has the same API
+        bs_single_array.load(in);
+    }
+    
+    size_t serialize(ostream& out, sdsl::structure_tree_node* s, std::string name) const {
+        // We need to check to make sure we're actually writing the correct numbers of bytes.
+        size_t start = out.tellp();
+        
+        // We just use the DYNAMIC serialization.
+        bs_single_array.serialize(out);
+        
+        // TODO: when https://github.com/nicolaprezza/DYNAMIC/issues/4 is closed,
+        // trust the sizes that DYNAMIC reports. For now, second-guess it and just
+        // look at how far the stream has actually moved.
+        size_t written = (size_t) out.tellp() - start;
+        
+        // And then do the structure tree stuff
+        sdsl::structure_tree_node* child = structure_tree::add_child(s, name, sdsl::util::class_name(bs_single_array));
+        sdsl::structure_tree::add_size(child, written);
+        
+        return written;
+    }
+    
+private:
+    // DYNAMIC's queries aren't const, though they don't change anything.
+    mutable rank_select_int_vector bs_single_array;
+};
+
+unique_ptr<BsStore> BsStore::make(int mode, size_t side_count) {
+    switch (mode) {
+    case MODE_SDSL:
+        return unique_ptr<BsStore>(new SdslBsStore(side_count));
+    case MODE_DYNAMIC:
+        return unique_ptr<BsStore>(new DynamicBsStore(side_count));
+    default:
+        cerr << "[xg] error: unknown gPBWT mode " << mode << endl;
+        exit(1);
+    }
+}
+
+void XG::index_thread_edges() {
+    // Sides run from 2 to max_node_rank() * 2 + 1, and we want one past that
+    // for the end of the last range.
+    size_t side_count = (max_node_rank() + 1) * 2;
+    vector<size_t> in_from, in_slot, out_to;
+    util::assign(wi_starts, int_vector<>(side_count + 1, 0));
+    util::assign(wo_starts, int_vector<>(side_count + 1, 0));
+    
+    for(size_t side = 2; side < side_count; side++) {
+        int64_t node_id = rank_to_id(side / 2);
+        bool is_reverse = side % 2;
+        
+        wi_starts[side] = in_from.size();
+        for(auto& edge : is_reverse ? edges_on_end(node_id) : edges_on_start(node_id)) {
+            // Work out the side this edge leaves from when we arrive by it
+            int64_t from_id;
+            bool from_is_reverse;
+            if(edge.to() == node_id && edge.to_end() == is_reverse) {
+                from_id = edge.from();
+                from_is_reverse = edge.from_start();
+            } else {
+                from_id = edge.to();
+                from_is_reverse = !edge.to_end();
+            }
+            in_from.push_back(id_to_rank(from_id) * 2 + from_is_reverse);
+            in_slot.push_back((edge_rank_as_entity(edge) - 1) * 2 + arrive_by_reverse(edge, node_id, is_reverse));
+        }
+        
+        wo_starts[side] = out_to.size();
+        for(auto& edge : is_reverse ? edges_on_start(node_id) : edges_on_end(node_id)) {
+            // Follow the edge the same way thread extraction does
+            int64_t other_node = edge.from() == node_id ? edge.to() : edge.from();
+            bool other_orientation = is_reverse != edge.from_start() != edge.to_end();
+            out_to.push_back(id_to_rank(other_node) * 2 + other_orientation);
+        }
+    }
+    wi_starts[side_count] = in_from.size();
+    wo_starts[side_count] = out_to.size();
+    
+    util::assign(wi_from_iv, int_vector<>(in_from.size()));
+    util::assign(wi_slot_iv, int_vector<>(in_slot.size()));
+    for(size_t i = 0; i < in_from.size(); i++) {
+        wi_from_iv[i] = in_from[i];
+        wi_slot_iv[i] = in_slot[i];
+    }
+    util::assign(wo_to_iv, int_vector<>(out_to.size()));
+    for(size_t i = 0; i < out_to.size(); i++) {
+        wo_to_iv[i] = out_to[i];
+    }
+    util::bit_compress(wi_starts);
+    util::bit_compress(wi_from_iv);
+    util::bit_compress(wi_slot_iv);
+    util::bit_compress(wo_starts);
+    util::bit_compress(wo_to_iv);
+}
+
+void XG::index_thread_edge_prefixes() {
+    if(wi_starts.empty()) {
+        // We never laid out the edges, so there's nothing to sum.
+        return;
+    }
+    util::assign(wi_prefix_iv, int_vector<>(wi_slot_iv.size()));
+    for(size_t side = 0; side + 1 < wi_starts.size(); side++) {
+        size_t total = 0;
+        for(size_t i = wi_starts[side]; i < wi_starts[side + 1]; i++) {
+            wi_prefix_iv[i] = total;
+            total += h_iv[wi_slot_iv[i]];
+        }
+    }
+    util::bit_compress(wi_prefix_iv);
+}
+
+void XG::bs_dump(ostream& out) const {
+    bs_store->dump(out);
 }
 
 size_t XG::count_matches(const thread_t& t) const {
@@ -3052,6 +4712,103 @@ size_t XG::count_matches(const Path& t) const {
     return count_matches(thread);
 }
 
+vector<size_t> XG::count_matches(const vector<thread_t>& threads) const {
+    vector<size_t> counts(threads.size());
+    
+    // Sort the threads so that any shared prefix is a contiguous run. Then the
+    // sorted order is a trie laid out flat, and each run at a depth is a node.
+    vector<size_t> order(threads.size());
+    iota(order.begin(), order.end(), 0);
+    auto visit_less = [](const ThreadMapping& a, const ThreadMapping& b) {
+        return a.node_id < b.node_id || (a.node_id == b.node_id && a.is_reverse < b.is_reverse);
+    };
+    auto visit_equal = [](const ThreadMapping& a, const ThreadMapping& b) {
+        return a.node_id == b.node_id && a.is_reverse == b.is_reverse;
+    };
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return lexicographical_compare(threads[a].begin(), threads[a].end(),
+                                           threads[b].begin(), threads[b].end(), visit_less);
+        });
+    
+    // Find the end of the run in [start, end) that shares the visit at depth
+    // with the thread at start, which must have one.
+    auto run_end = [&](size_t start, size_t end, size_t depth) {
+        const ThreadMapping& visit = threads[order[start]][depth];
+        size_t i = start + 1;
+        while(i < end && threads[order[i]].size() > depth && visit_equal(threads[order[i]][depth], visit)) {
+            i++;
+        }
+        return i;
+    };
+    
+    // Everything in a run's [start, end) shares its first depth visits, which
+    // its state has searched. Threads that end there come first in sorted
+    // order. Runs wait on an explicit stack, and a run carries on into its
+    // last child in place, so a long unbranched thread costs neither stack
+    // frames nor state copies.
+    struct run_t {
+        ThreadSearchState state;
+        size_t start;
+        size_t end;
+        size_t depth;
+    };
+    auto search_run = [&](const run_t& first_run) {
+        vector<run_t> stack(1, first_run);
+        while(!stack.empty()) {
+            run_t run = stack.back();
+            stack.pop_back();
+            while(true) {
+                while(run.start < run.end && threads[order[run.start]].size() == run.depth) {
+                    counts[order[run.start++]] = run.state.count();
+                }
+                if(run.start == run.end) {
+                    break;
+                }
+                if(run.state.is_empty()) {
+                    // A single search would stop here too
+                    for(size_t i = run.start; i < run.end; i++) {
+                        counts[order[i]] = run.state.count();
+                    }
+                    break;
+                }
+                // Every child run but the last waits its turn on the stack
+                size_t next = run_end(run.start, run.end, run.depth);
+                while(next < run.end) {
+                    run_t child = {run.state, run.start, next, run.depth + 1};
+                    extend_search(child.state, threads[order[run.start]][run.depth]);
+                    stack.push_back(child);
+                    run.start = next;
+                    next = run_end(run.start, run.end, run.depth);
+                }
+                extend_search(run.state, threads[order[run.start]][run.depth]);
+                run.depth++;
+            }
+        }
+    };
+    
+    // Empty threads match everything, like an unextended search
+    size_t first = 0;
+    while(first < order.size() && threads[order[first]].empty()) {
+        counts[order[first++]] = ThreadSearchState().count();
+    }
+    
+    // The runs sharing a first visit are independent subtrees
+    vector<pair<size_t, size_t> > groups;
+    for(size_t start = first; start < order.size(); ) {
+        size_t next = run_end(start, order.size(), 0);
+        groups.push_back(make_pair(start, next));
+        start = next;
+    }
+#pragma omp parallel for schedule(dynamic, 1)
+    for(size_t i = 0; i < groups.size(); i++) {
+        run_t run = {ThreadSearchState(), groups[i].first, groups[i].second, 1};
+        extend_search(run.state, threads[order[groups[i].first]][0]);
+        search_run(run);
+    }
+    
+    return counts;
+}
+
 void XG::extend_search(ThreadSearchState& state, const thread_t& t) const {
     
 #ifdef VERBOSE_DEBUG
@@ -3070,7 +4827,6 @@ void XG::extend_search(ThreadSearchState& state, const thread_t& t) const {
     
     for(int64_t i = 0; i < t.size(); i++) {
         // For each item in the path
-        const ThreadMapping& mapping = t[i];
         
         if(state.is_empty()) {
             // Don't bother trying to extend empty things.
@@ -3082,86 +4838,54 @@ void XG::extend_search(ThreadSearchState& state, const thread_t& t) const {
             break;
         }
         
-        // TODO: make this mapping to side thing a function
-        int64_t next_id = mapping.node_id;
-        bool next_is_reverse = mapping.is_reverse;
-        int64_t next_side = id_to_rank(next_id) * 2 + next_is_reverse;
-        
+        extend_search(state, t[i]);
+    }
+}
+
+void XG::extend_search(ThreadSearchState& state, const ThreadMapping& mapping) const {
+    // TODO: make this mapping to side thing a function
+    int64_t next_id = mapping.node_id;
+    bool next_is_reverse = mapping.is_reverse;
+    int64_t next_side = id_to_rank(next_id) * 2 + next_is_reverse;
+    
 #ifdef VERBOSE_DEBUG
-        cerr << "Extend mapping to " << state.current_side << " range " << state.range_start << " to " << state.range_end << " with " << next_side << endl;
+    cerr << "Extend mapping to " << state.current_side << " range " << state.range_start << " to " << state.range_end << " with " << next_side << endl;
 #endif
+    
+    if(state.current_side == 0) {
+        // If the state is a start state, just select the whole node using
+        // the node usage count in this orientation. TODO: orientation not
+        // really important unless we're going to search during a path
+        // addition.
+        state.range_start = 0;
+        state.range_end = h_iv[(node_rank_as_entity(next_id) - 1) * 2 + next_is_reverse];
         
-        if(state.current_side == 0) {
-            // If the state is a start state, just select the whole node using
-            // the node usage count in this orientation. TODO: orientation not
-            // really important unless we're going to search during a path
-            // addition.
-            state.range_start = 0;
-            state.range_end = h_iv[(node_rank_as_entity(next_id) - 1) * 2 + next_is_reverse];
-            
 #ifdef VERBOSE_DEBUG
-            cerr << "\tFound " << state.range_end << " threads present here." << endl;
-            
-            int64_t here = (node_rank_as_entity(next_id) - 1) * 2 + next_is_reverse;
-            cerr << here << endl;
-            for(int64_t i = here - 5; i < here + 5; i++) {
-                if(i >= 0) {
-                    cerr << "\t\t" << (i == here ? "*" : " ") << "h_iv[" << i << "] = " << h_iv[i] << endl;
-                }
+        cerr << "\tFound " << state.range_end << " threads present here." << endl;
+        
+        int64_t here = (node_rank_as_entity(next_id) - 1) * 2 + next_is_reverse;
+        cerr << here << endl;
+        for(int64_t i = here - 5; i < here + 5; i++) {
+            if(i >= 0) {
+                cerr << "\t\t" << (i == here ? "*" : " ") << "h_iv[" << i << "] = " << h_iv[i] << endl;
             }
-            
+        }
+        
 #endif
-            
-        } else {
-            // Else, look at where the path goes to and apply the where_to function to shrink the range down.
-            state.range_start = where_to(state.current_side, state.range_start, next_side);
-            state.range_end = where_to(state.current_side, state.range_end, next_side);
-            
+        
+    } else {
+        // Else, look at where the path goes to and apply the where_to function to shrink the range down.
+        state.range_start = where_to(state.current_side, state.range_start, next_side);
+        state.range_end = where_to(state.current_side, state.range_end, next_side);
+        
 #ifdef VERBOSE_DEBUG
-            cerr << "\tFound " << state.range_start << " to " << state.range_end << " threads continuing through." << endl;
+        cerr << "\tFound " << state.range_start << " to " << state.range_end << " threads continuing through." << endl;
 #endif
-            
-        }
         
-        // Update the side that the state is on
-        state.current_side = next_side;
     }
-}
-
-size_t serialize(XG::rank_select_int_vector& to_serialize, ostream& out,
-    sdsl::structure_tree_node* parent, const std::string name) {
-#if GPBWT_MODE == MODE_SDSL
-    // Just delegate to the SDSL code
-    return to_serialize.serialize(out, parent, name);
-
-#elif GPBWT_MODE == MODE_DYNAMIC
-    // We need to check to make sure we're actually writing the correct numbers of bytes.
-    size_t start = out.tellp();
-    
-    // We just use the DYNAMIC serialization.  
-    size_t written = to_serialize.serialize(out);
-    
-    // TODO: when https://github.com/nicolaprezza/DYNAMIC/issues/4 is closed,
-    // trust the sizes that DYNAMIC reports. For now, second-guess it and just
-    // look at how far the stream has actually moved.
-    written = (size_t) out.tellp() - start;
     
-    // And then do the structure tree stuff
-    sdsl::structure_tree_node* child = structure_tree::add_child(parent, name, sdsl::util::class_name(to_serialize));
-    sdsl::structure_tree::add_size(child, written);
-    
-    return written;
-#endif
-}
-
-void deserialize(XG::rank_select_int_vector& target, istream& in) {
-#if GPBWT_MODE == MODE_SDSL
-    // We just load using the SDSL deserialization code
-    target.load(in);
-#elif GPBWT_MODE == MODE_DYNAMIC
-    // The DYNAMIC code has the same API
-    target.load(in);
-#endif
+    // Update the side that the state is on
+    state.current_side = next_side;
 }
 
 bool edges_equivalent(const Edge& e1, const Edge& e2) {
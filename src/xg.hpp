@@ -4,6 +4,7 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <omp.h>
 #include "cpp/vg.pb.h"
 #include "sdsl/bit_vectors.hpp"
@@ -16,16 +17,13 @@
 #include "sdsl/suffix_arrays.hpp"
 #include "hash_map_set.hpp"
 
-// We can have DYNAMIC or SDSL-based gPBWTs
+// We can have DYNAMIC or SDSL-based gPBWTs, chosen when each index is built
 #define MODE_DYNAMIC 1
 #define MODE_SDSL 2
 
+// The one we build when nobody asks for the other
 #define GPBWT_MODE MODE_SDSL
 
-#if GPBWT_MODE == MODE_DYNAMIC
-#include "dynamic.hpp"
-#endif
-
 namespace xg {
 
 using namespace std;
@@ -33,6 +31,38 @@ using namespace sdsl;
 using namespace vg;
 
 class XGPath;
+
+// Storage for the gPBWT's B_s arrays: for each side, the local edge number + 2
+// (or NULL_DESTINATION) that each visit there leaves by. MODE_SDSL stores are
+// filled in side by side and then baked into a static structure for fast
+// queries; MODE_DYNAMIC stores can take inserts at any time, but answer more
+// slowly. Sides are from 1-based node ranks, so start at 2.
+class BsStore {
+public:
+    static const size_t NULL_DESTINATION = 0;
+    static const size_t SEPARATOR = 1;
+    
+    virtual ~BsStore(void) { }
+    // Which MODE_ this is.
+    virtual int mode(void) const = 0;
+    virtual size_t get(int64_t side, int64_t offset) const = 0;
+    // Count entries equal to value on side before offset.
+    virtual size_t rank(int64_t side, int64_t offset, size_t value) const = 0;
+    virtual void set(int64_t side, const vector<size_t>& new_array) = 0;
+    virtual void insert(int64_t side, int64_t offset, size_t value) = 0;
+    virtual void bake(void) = 0;
+    // Fold anything inserted since the last bake into the query structure.
+    virtual void compact(void) { }
+    // Has enough been inserted since the last bake that compact() would pay?
+    virtual bool wants_compaction(void) const { return false; }
+    virtual void dump(ostream& out) const = 0;
+    virtual void load(istream& in) = 0;
+    virtual size_t serialize(std::ostream& out,
+                             sdsl::structure_tree_node* v = NULL,
+                             std::string name = "") const = 0;
+    // Make an empty store of a mode, with room for side_count sides.
+    static unique_ptr<BsStore> make(int mode, size_t side_count);
+};
 //typedef pair<int64_t, bool> Side;
 typedef int64_t id_t; // generic id type
 // node sides
@@ -46,6 +76,12 @@ id_t trav_id(const trav_t& trav);
 bool trav_is_rev(const trav_t& trav);
 int32_t trav_rank(const trav_t& trav);
 trav_t make_trav(id_t id, bool is_end, int32_t rank);
+// positions on node strands
+typedef tuple<id_t, bool, size_t> pos_t; // id, is_rev, offset along the strand
+id_t pos_id(const pos_t& pos);
+bool pos_is_rev(const pos_t& pos);
+size_t pos_offset(const pos_t& pos);
+pos_t make_pos(id_t id, bool is_rev, size_t offset);
 
 
 class XG {
@@ -62,19 +98,29 @@ public:
     XG(Graph& graph);
     XG(function<void(function<void(Graph&)>)> get_chunks);
     
-    // We cannot move, assign, or copy until we add code to point SDSL suppots
-    // at the new addresses for their vectors.
+    // We can't copy, because the SDSL supports point at their vectors, but we
+    // can move by swapping and re-seating the supports.
     XG(const XG& other) = delete;
-    XG(XG&& other) = delete;
+    XG(XG&& other);
     XG& operator=(const XG& other) = delete;
-    XG& operator=(XG&& other) = delete;
+    XG& operator=(XG&& other);
+    // Exchange contents with another index, pointing all the rank and select
+    // supports at their vectors' new homes.
+    void swap(XG& other);
     
+    // If order_by_locality is true, node ranks follow a topological order of
+    // the graph (breaking cycles at the lowest id left) rather than the ids,
+    // so that nodes near each other in the graph sit near each other in the
+    // index. Ids are unchanged. The gpbwt_mode picks the B_s storage for
+    // threads, and is recorded in the serialized index.
     void from_stream(istream& in, bool validate_graph = false,
         bool print_graph = false, bool store_threads = false,
-        bool is_sorted_dag = false);
+        bool is_sorted_dag = false, bool order_by_locality = false,
+        int gpbwt_mode = GPBWT_MODE);
     void from_graph(Graph& graph, bool validate_graph = false,
         bool print_graph = false, bool store_threads = false,
-        bool is_sorted_dag = false);
+        bool is_sorted_dag = false, bool order_by_locality = false,
+        int gpbwt_mode = GPBWT_MODE);
     // Load the graph by calling a function that calls us back with graph chunks.
     // The function passed in here is responsible for looping.
     // If is_sorted_dag is true and store_threads is true, we store the threads
@@ -82,7 +128,8 @@ public:
     // is faster.
     void from_callback(function<void(function<void(Graph&)>)> get_chunks,
         bool validate_graph = false, bool print_graph = false,
-        bool store_threads = false, bool is_sorted_dag = false); 
+        bool store_threads = false, bool is_sorted_dag = false,
+        bool order_by_locality = false, int gpbwt_mode = GPBWT_MODE);
     void build(map<id_t, string>& node_label,
                map<side_t, set<side_t> >& from_to,
                map<side_t, set<side_t> >& to_from,
@@ -90,8 +137,21 @@ public:
                bool validate_graph,
                bool print_graph,
                bool store_threads,
-               bool is_sorted_dag);
+               bool is_sorted_dag,
+               bool order_by_locality = false,
+               int gpbwt_mode = GPBWT_MODE);
+    // Order the nodes topologically for ranking, as build does when asked.
+    vector<id_t> topological_order(const map<id_t, string>& node_label,
+                                   const map<side_t, set<side_t> >& from_to) const;
+    // Serialized indexes start with this magic number and then the format
+    // version, which goes up whenever what follows changes.
+    static const uint32_t FILE_MAGIC = 0x78676978; // "xgix"
+    static const uint32_t FILE_VERSION = 1;
+    // Load an index, exiting with an error if the stream doesn't hold one.
     void load(istream& in);
+    // Load an index, throwing runtime_error instead if the stream is missing,
+    // truncated, not an index, or an index of another format version.
+    void load_checked(istream& in);
     size_t serialize(std::ostream& out,
                      sdsl::structure_tree_node* v = NULL,
                      std::string name = "");
@@ -115,6 +175,8 @@ public:
     int64_t where_to(int64_t current_side, int64_t visit_offset, int64_t new_side,
       vector<Edge>& edges_into_new, vector<Edge>& edges_out_of_old) const;
 
+    // Returns true if a node with the given ID is in the graph.
+    bool has_node(int64_t id) const;
     size_t id_to_rank(int64_t id) const;
     int64_t rank_to_id(size_t rank) const;
     size_t max_node_rank(void) const;
@@ -124,6 +186,27 @@ public:
     string node_sequence(int64_t id) const;
     size_t node_length(int64_t id) const;
     char pos_char(int64_t id, bool is_rev, size_t off) const; // character at position
+    // Build the FM-index over the node sequences and their reverse complements
+    // that find_sequence uses.
+    void index_sequence_search(void);
+    bool has_sequence_search(void) const;
+    // Find every occurrence of a sequence inside a single node strand. Offsets
+    // on the reverse strand count from the end of the node, as for pos_char.
+    // Empty if the FM-index wasn't built.
+    vector<pos_t> find_sequence(const string& pattern) const;
+    // The sequence of a node, by rank, on the given strand.
+    string strand_sequence(size_t rank, bool is_rev) const;
+    // Call the lambda with every k-mer in the graph, on both strands, and the
+    // position of each of its bases. K-mers run across edges wherever a node
+    // is too short to hold them. Taking one of several edges out of a side is
+    // a branch, and k-mers that take more than branch_max branches are left
+    // out, so dense variation can't blow up the walks. Nodes are walked in
+    // parallel, so the lambda is called from many threads at once.
+    void for_each_kmer(size_t k, const function<void(const string&, const vector<pos_t>&)>& lambda,
+                       size_t branch_max = DEFAULT_BRANCH_MAX) const;
+    static const size_t DEFAULT_BRANCH_MAX = 10;
+    // decode the bases in [start, end) of the sequence vector onto seq
+    void append_sequence(size_t start, size_t end, string& seq) const;
     string pos_substr(int64_t id, bool is_rev, size_t off, size_t len = 0) const; // substring in range
     vector<Edge> edges_of(int64_t id) const;
     vector<Edge> edges_to(int64_t id) const;
@@ -145,6 +228,13 @@ public:
     bool has_edge(int64_t id1, bool is_start, int64_t id2, bool is_end) const;
     /// Returns true if the given edge is present in either orientation, and false otherwise.
     bool has_edge(const Edge& edge) const;
+    /// Build the packed per-node records that the node, sequence and edge
+    /// lookups read from when they are present.
+    void index_node_records(void);
+    /// Calls the lambda with the node rank and end-ness of every side joined
+    /// by an edge to the given side. Self loops may be reported twice.
+    void for_each_edge_on_side(size_t rank, bool is_end,
+                               const function<void(size_t, bool)>& lambda) const;
 
     // Pull out the path with the given name.
     Path path(const string& name) const;
@@ -173,6 +263,12 @@ public:
     vector<size_t> node_positions_in_path(int64_t id, const string& name) const;
     vector<size_t> node_positions_in_path(int64_t id, size_t rank) const;
     map<string, vector<size_t> > node_positions_in_paths(int64_t id, bool is_rev = false) const;
+    // Every visit of every path to the node, as (path rank, offset of the node
+    // start, orientation), sorted by path rank and then offset.
+    vector<tuple<size_t, size_t, bool> > node_path_positions(int64_t id) const;
+    // Build the per-node overlay of path positions, so the above are a single
+    // scan instead of a round of wavelet tree queries per path.
+    void index_node_positions(void);
     int64_t node_at_path_position(const string& name, size_t pos) const;
     Mapping mapping_at_path_position(const string& name, size_t pos) const;
     size_t path_length(const string& name) const;
@@ -183,18 +279,60 @@ public:
     // if node is on path, return it.  otherwise, return previous node (in id space)
     // that is on path.  if none exists, return 0
     int64_t prev_path_node_by_id(size_t path_rank, int64_t id) const;
-    // estimate distance (in bp) between two nodes along a path.
-    // if a nodes isn't on the path, the nearest node on the path (using id space)
-    // is used as a proxy.  
+    // Project every node within max_distance bp of each path onto the path,
+    // so that path distances can be found for nodes just off the path.
+    void index_path_projections(size_t max_distance);
+    // The ranks of the paths a node off them projects onto, sorted. Empty
+    // unless projections are indexed.
+    vector<size_t> paths_projected_from(int64_t id) const;
+    // distance (in bp) between two nodes along a path, from the end of the
+    // earlier to the start of the later, over their closest visits. A node off
+    // the path stands in at its projection, if it has one. -1 if not found.
+    int64_t path_distance(size_t path_rank, int64_t id1, int64_t id2) const;
+    // as above, by path name
     int64_t approx_path_distance(const string& name, int64_t id1, int64_t id2) const;
     // like above, but find minumum over list of paths.  if names is empty, do all paths
+    // paths through both nodes are preferred, then paths through either
     int64_t min_approx_path_distance(const vector<string>& names, int64_t id1, int64_t id2) const;
+    // the same for many pairs of nodes at once, in parallel, looking each node
+    // up only once. if path_ranks is empty, do all paths
+    vector<int64_t> min_path_distances(const vector<pair<int64_t, int64_t> >& pairs,
+                                       const vector<size_t>& path_ranks = vector<size_t>()) const;
+    
+    // The visits of a node to the paths through it, for computing distances.
+    struct NodePathVisits {
+        int64_t id = 0;
+        // sorted, and in step with intervals
+        vector<size_t> path_ranks;
+        // the [start, end) of each visit to each path, sorted by start
+        vector<vector<pair<int64_t, int64_t> > > intervals;
+    };
+    // Find the visits of a node to all its paths, or to only the given one.
+    NodePathVisits node_path_visits(int64_t id, size_t only_path_rank = 0) const;
+    int64_t path_distance(size_t path_rank, const NodePathVisits& visits1,
+                          const NodePathVisits& visits2) const;
+    // allowed must be sorted. if it is empty, do all paths
+    int64_t min_path_distance(const NodePathVisits& visits1, const NodePathVisits& visits2,
+                              const vector<size_t>& allowed) const;
 
 
     // use_steps flag toggles whether dist refers to steps or length in base pairs
     void neighborhood(int64_t id, size_t dist, Graph& g, bool use_steps = true) const;
     //void for_path_range(string& name, int64_t start, int64_t stop, function<void(Node)> lambda);
-    void get_path_range(string& name, int64_t start, int64_t stop, Graph& g, bool is_rev = false) const;
+    // Get the nodes visited by the path between start and stop (inclusive),
+    // the path's mappings within that range, and optionally the nodes' edges.
+    // Negative coordinates select the whole path.
+    void get_path_range(string& name, int64_t start, int64_t stop, Graph& g, bool is_rev = false,
+                        bool with_edges = true) const;
+    // Get the sequence of a path between start and end (inclusive), read off
+    // the reverse strand if is_rev. Coordinates are clipped as above.
+    string path_substr(const string& name, int64_t start, int64_t end, bool is_rev = false) const;
+    string path_substr(size_t path_rank, int64_t start, int64_t end, bool is_rev = false) const;
+    // Write the paths whose names begin with prefix (all, if it's empty) as
+    // FASTA. Each path is decoded in chunks of about chunk_size bases in
+    // parallel, and the chunks are written in order.
+    void write_path_fasta(ostream& out, const string& prefix = "", size_t line_width = 60,
+                          size_t chunk_size = 1 << 20) const;
     // basic method to query regions of the graph
     // add_paths flag allows turning off the (potentially costly, and thread-locking) addition of paths
     // when these are not necessary
@@ -220,13 +358,8 @@ public:
 
     // gPBWT interface
     
-#if GPBWT_MODE == MODE_SDSL
-    // We keep our strings in instances of this cool run-length-compressed wavelet tree.
-    using rank_select_int_vector = sdsl::wt_rlmn<sdsl::sd_vector<>>;
-#elif GPBWT_MODE == MODE_DYNAMIC
-    using rank_select_int_vector = dyn::rle_str;
-#endif
-    
+    // Which MODE_ the index keeps its B_s arrays in.
+    int gpbwt_mode(void) const;
     
     // We define a thread visit that's much smaller than a Protobuf Mapping.
     struct ThreadMapping {
@@ -253,14 +386,34 @@ public:
     // Otherwise the gPBWT data structures will be left in an inconsistent
     // state.
     void insert_threads_into_dag(const vector<thread_t>& t);
+    // Insert a whole group of threads into any graph, including ones with
+    // cycles and inversions. Every visit is sorted by the path back to where
+    // its thread started, by prefix doubling, which gives each side's B_s
+    // array in one go. Like insert_threads_into_dag, this must be called only
+    // once, on an index with no threads.
+    void insert_threads(const vector<thread_t>& t);
+    // Add threads to an index that already has its threads baked, as when it
+    // was loaded from disk. Every step must be on a node and edge of the
+    // graph; if one isn't, we stop with an error before changing anything.
+    // In SDSL mode the inserts are kept next to the static B_s, and folded
+    // in once at the end if they have grown big, or else when serializing.
+    void add_threads(const vector<thread_t>& t);
     // Read all the threads embedded in the graph.
     list<thread_t> extract_threads() const;
+    // Walk all the threads embedded in the graph in parallel, calling the
+    // lambda with each one's number in extract_threads order as soon as it is
+    // done. The lambda may be called from several threads at once.
+    void for_each_thread(const function<void(size_t, const thread_t&)>& lambda) const;
     // Extract a particular thread, referring to it by its offset at node; step
     // it out to a maximum of max_length
     thread_t extract_thread(xg::XG::ThreadMapping node, int64_t offset, int64_t max_length);
     // Count matches to a subthread among embedded threads
     size_t count_matches(const thread_t& t) const;
     size_t count_matches(const Path& t) const;
+    // Count matches to each of a batch of subthreads. Threads sharing a prefix
+    // share the search steps for it, and threads with different first visits
+    // are searched in parallel.
+    vector<size_t> count_matches(const vector<thread_t>& threads) const;
     
     /**
      * Represents the search state for the graph PBWT, so that you can continue
@@ -290,6 +443,8 @@ public:
     
     // Extend a search with the given section of a thread.
     void extend_search(ThreadSearchState& state, const thread_t& t) const;
+    // Extend a search with a single visit.
+    void extend_search(ThreadSearchState& state, const ThreadMapping& mapping) const;
 
     // Dump the whole B_s array to the given output stream as a report.
     void bs_dump(ostream& out) const;
@@ -311,6 +466,8 @@ private:
     rrr_vector<> s_cbv;
     rrr_vector<>::rank_1_type s_cbv_rank;
     rrr_vector<>::select_1_type s_cbv_select;
+    // optional FM-index over s_iv followed by its reverse complement
+    csa_wt<> s_csa;
 
     // maintain old ids from input, ranked as in s_iv and s_bv
     int_vector<> i_iv;
@@ -341,6 +498,15 @@ private:
     sd_vector<> t_from_start_cbv;
     sd_vector<> t_to_end_cbv;
 
+    // optional packed node records, one contiguous run per node rank starting
+    // at nr_starts[rank-1]: sequence start in s_iv, length, edge count, how
+    // many of the edges are recorded from this node, and then each edge as
+    // (other rank << 2 | our side is end << 1 | their side is end), those from
+    // this node first. Looking at a node then touches one place instead of a
+    // dozen.
+    int_vector<> nr_starts;
+    int_vector<> nr_block;
+
     // edge table, allows o(1) determination of edge existence
     int_vector<> e_iv;
 
@@ -368,6 +534,20 @@ private:
     rank_support_v<1> ep_bv_rank;
     bit_vector::select_1_type ep_bv_select;
     
+    // node->path position overlay, laid out like ep_iv: a marked header slot
+    // per node rank, then the path rank and (offset*2 + is_reverse) of each
+    // visit to it. Empty unless built with index_node_positions().
+    int_vector<> np_iv;
+    int_vector<> np_pos_iv;
+    bit_vector np_bv;
+    bit_vector::select_1_type np_bv_select;
+    
+    // node->projected path lookup: the ranks of the paths node rank r projects
+    // onto are pj_iv[pj_starts[r-1]] to pj_iv[pj_starts[r]-1]. Empty unless
+    // built with index_path_projections().
+    int_vector<> pj_starts;
+    int_vector<> pj_iv;
+    
     // Succinct thread storage
     
     // Threads are haplotype paths in the graph with no edits allowed, starting
@@ -401,20 +581,29 @@ private:
     // ts stands for "thread start"
     int_vector<> ts_iv;
     
-#if GPBWT_MODE == MODE_SDSL
-    // We use this for creating the sub-parts of the uncompressed B_s arrays.
-    // We don't really support rank and select on this.
-    vector<string> bs_arrays;
-#endif
+    // These hold, for every side (as rank * 2 + is_reverse), the edges that
+    // where_to would otherwise rebuild as Edge objects on every step. The
+    // incoming edges of side s are at [wi_starts[s], wi_starts[s+1]), in the
+    // order edges_on_start/edges_on_end give them, each with the side it comes
+    // from and its oriented h_iv slot. wi_prefix_iv holds the total usage of
+    // the incoming edges before each one; it is filled in once the usage
+    // counts are final and cleared whenever they change again. The outgoing
+    // edges of side s are at [wo_starts[s], wo_starts[s+1]), in B_s local edge
+    // number order, each as the side it goes to.
+    int_vector<> wi_starts;
+    int_vector<> wi_from_iv;
+    int_vector<> wi_slot_iv;
+    int_vector<> wi_prefix_iv;
+    int_vector<> wo_starts;
+    int_vector<> wo_to_iv;
     
-    // This holds the concatenated Benedict arrays, with BS_SEPARATOR separating
-    // them, and BS_NULL noting the null side (i.e. the thread ends at this
-    // node). Instead of holding destination sides, we actually hold the index
+    // This holds the Benedict arrays, with BS_NULL noting the null side (i.e.
+    // the thread ends at this node), in whichever backend the index was built
+    // with. Instead of holding destination sides, we actually hold the index
     // of the edge that gets taken to the destination side, out of all edges we
     // could take leaving the node. We offset all the values up by 2, to make
-    // room for the null sentinel and the separator. Currently the separator
-    // isn't used; we just place these by side.
-    rank_select_int_vector bs_single_array;
+    // room for the null sentinel and the separator.
+    unique_ptr<BsStore> bs_store;
     
     // A "destination" is either a local edge number + 2, BS_NULL for stopping,
     // or possibly BS_SEPARATOR for cramming multiple Benedict arrays into one.
@@ -439,8 +628,16 @@ private:
     void bs_insert(int64_t side, int64_t offset, destination_t value);
     
     // Prepare the B_s array data structures for query. After you call this, you
-    // shouldn't call bset or bs_insert.
+    // shouldn't call bs_set, and bs_insert may be slow until the next bake.
     void bs_bake();
+    
+    // Build the per-side incoming and outgoing edge lists used by where_to.
+    void index_thread_edges();
+    // Fill in the incoming edge usage prefix sums from the current h_iv.
+    void index_thread_edge_prefixes();
+    // Follow the thread visit at offset on side to its next visit, updating
+    // both. Returns false, leaving them alone, if the thread ends there.
+    bool thread_step(int64_t& side, int64_t& offset) const;
 };
 
 class XGPath {
@@ -475,26 +672,85 @@ public:
     bit_vector offsets;
     rank_support_v<1> offsets_rank;
     bit_vector::select_1_type offsets_select;
+    // Nodes near but off the path, by rank, with the path position each one
+    // projects to and its distance from there. Empty unless indexed.
+    int_vector<> proj_ranks;
+    int_vector<> proj_positions;
+    int_vector<> proj_dists;
+    // Look up the projection of an off-path node. False if it has none.
+    bool projection(size_t node_rank, size_t& pos, size_t& dist) const;
     void load(istream& in);
     size_t serialize(std::ostream& out,
                      sdsl::structure_tree_node* v = NULL,
                      std::string name = "") const;
     // Get a mapping. Note that the mapping will not have its lengths filled in.
     Mapping mapping(size_t offset) const; // 0-based
+    
+    // One visit along the path.
+    struct Step {
+        size_t index;    // which visit this is, 0-based
+        int64_t id;
+        bool is_reverse;
+        size_t offset;   // path position of the visit's first base
+        size_t length;   // taken from the positions, not the node
+    };
+    
+    // Walks the visits of a path one at a time, forward or backward, without
+    // building any Mappings or looking up node lengths.
+    class StepIterator {
+    public:
+        StepIterator(const XGPath& path, size_t index, bool backward = false);
+        bool done(void) const { return at_end; }
+        const Step& operator*(void) const { return step; }
+        const Step* operator->(void) const { return &step; }
+        StepIterator& operator++(void);
+    private:
+        void load(void);
+        const XGPath* path;
+        Step step;
+        bool backward;
+        bool at_end;
+    };
+    
+    // Start walking from the visit covering the given path position (0-based).
+    // The walk is already done if the position is past the end of the path.
+    StepIterator steps_from(size_t pos, bool backward = false) const;
 };
 
 
+// A shared handle on the current index for long-running processes. Readers
+// take a reference with get() and hold it for the length of a request; a
+// writer can load or build a new index off to the side and publish it with
+// replace(). The old index is freed when the last reader lets go of it, so
+// nobody ever sees it half-built or half-freed.
+class XGHandle {
+public:
+    XGHandle(void) { }
+    XGHandle(shared_ptr<const XG> index) : current(index) { }
+    XGHandle(const XGHandle& other) = delete;
+    XGHandle& operator=(const XGHandle& other) = delete;
+    
+    // Get the index that is current right now.
+    shared_ptr<const XG> get(void) const;
+    // Publish a new index, returning the one it replaced.
+    shared_ptr<const XG> replace(shared_ptr<const XG> index);
+    // Load an index from the given file and publish it. Returns false, with
+    // the reason in error and the current index left in place, if the file
+    // can't be opened or doesn't hold a whole index.
+    bool reload(const string& filename, string& error);
+    
+private:
+    shared_ptr<const XG> current;
+};
+
 Mapping new_mapping(const string& name, int64_t id, size_t rank, bool is_reverse);
 void parse_region(const string& target, string& name, int64_t& start, int64_t& end);
+// Temporary files go in the directory given here, or else in $TMPDIR, or else
+// in /tmp.
+void set_temp_dir(const string& dir);
+string temp_dir(void);
 void to_text(ostream& out, Graph& graph);
 
-// Serialize a rank_select_int_vector in an SDSL serialization compatible way. Returns the number of bytes written.
-size_t serialize(XG::rank_select_int_vector& to_serialize, ostream& out,
-    sdsl::structure_tree_node* parent, const std::string name);
-
-// Deserialize a rank_select_int_vector in an SDSL serialization compatible way.
-void deserialize(XG::rank_select_int_vector& target, istream& in);
-
 // Determine if two edges are equivalent (the same or one is the reverse of the other)
 bool edges_equivalent(const Edge& e1, const Edge& e2);
 
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# Compare the gPBWT backends on the same graphs: time to build an index with
+# threads, its size on disk, and time to extract the threads again.
+#
+#   ./bench_gpbwt.sh [-d] graph.vg [graph.vg ...]
+#
+# Pass -d if the graphs are sorted DAGs, to use the DAG batch insert for sdsl.
+
+XG=${XG:-../bin/xg}
+DAG=
+if [ "$1" == "-d" ]; then
+    DAG=-d
+    shift
+fi
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-d] graph.vg [graph.vg ...]" >&2
+    exit 1
+fi
+
+# seconds between two date +%s.%N stamps
+elapsed() {
+    echo "$1 $2" | awk '{ printf "%.2f", $2 - $1 }'
+}
+
+printf "graph\tmode\tbuild_s\tbytes\textract_s\tthreads\n"
+for graph in "$@"; do
+    for mode in sdsl dynamic; do
+        idx=$(mktemp)
+        start=$(date +%s.%N)
+        $XG -Y $mode -r $DAG -v "$graph" -o "$idx" 2>/dev/null || { echo "$graph: $mode build failed" >&2; rm -f "$idx"; continue; }
+        built=$(date +%s.%N)
+        threads=$($XG -i "$idx" -x -T | cut -f 3 | grep _thread_ | sort -u | wc -l)
+        extracted=$(date +%s.%N)
+        printf "%s\t%s\t%s\t%s\t%s\t%s\n" "$graph" $mode $(elapsed $start $built) \
+               $(wc -c < "$idx") $(elapsed $built $extracted) $threads
+        rm -f "$idx"
+    done
+done
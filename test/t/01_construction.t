@@ -5,17 +5,33 @@ BASH_TAP_ROOT=../bash-tap
 
 PATH=../bin:$PATH # for xg
 
-plan tests 12
+plan tests 18
 
 is $(xg -Vv data/l.vg 2>&1 | grep ok | wc -l) 1 "a small graph verifies"
 is $(xg -Vv data/lg.vg 2>&1 | grep ok | wc -l) 1 "a small graph with two named paths verifies"
 is $(xg -Vrv data/lg.vg 2>&1 | grep ok | wc -l) 1 "a small graph with threads verifies"
 is $(xg -Vrdv data/lg.vg 2>&1 | grep ok | wc -l) 1 "a small graph with batch-inserted threads verifies"
+is $(xg -rdv data/lg.vg -x -T | cut -f 3 | grep _thread_ | sort -u | wc -l) 4 "threads are extracted in both orientations"
+xg -Y dynamic -rv data/lg.vg -o lgd.idx 2>/dev/null
+is $(xg -i lgd.idx -x -T | cut -f 3 | grep _thread_ | sort -u | wc -l) 4 "threads can be kept in a dynamic gPBWT that is recorded in the index"
+rm -f lgd.idx
+# Each extracted thread as its node and strand steps, one per line, sorted
+thread_steps() { awk -F'\t' '$1 == "P" && $3 ~ /^_thread_/ { s[$3] = s[$3] $2 $5 "," } END { for (n in s) print s[n] }' | sort; }
+xg -rv data/lg.vg -o lg.idx 2>/dev/null
+xg -i lg.idx -x -T | thread_steps > threads.txt
+cat threads.txt threads.txt | sort > doubled.txt
+is $(xg -i lg.idx -a data/lg.vg -x -T | thread_steps | md5sum | cut -f 1 -d\ ) $(md5sum < doubled.txt | cut -f 1 -d\ ) "threads can be added to a loaded index"
+xg -i lg.idx -a data/lg.vg -o lg2.idx 2>/dev/null
+is $(xg -i lg2.idx -x -T | thread_steps | md5sum | cut -f 1 -d\ ) $(md5sum < doubled.txt | cut -f 1 -d\ ) "added threads survive saving and reloading the index"
+rm -f lg.idx lg2.idx threads.txt doubled.txt
 is $(xg -Vrv data/l+.vg 2>&1 | grep ok | wc -l) 1 "node ids need not start at 1"
 is $(xg -Vrdv data/z.vg 2>&1 | grep ok | wc -l) 1 "a 1mb graph verifies"
 xg -Vv data/z.vg -o data/z.vg.idx 2>/dev/null
 is $? 0 "serialization works"
 rm -f data/z.vg.idx
+echo junk > junk.idx
+is $(xg -i junk.idx -s 1 2>&1 | grep -c "not an xg index") 1 "files that are not indexes are refused clearly"
+rm -f junk.idx
 xg -Vv data/with_m.vg 2>/dev/null
 is $? 0 "graphs can be compressed even with M"
 
@@ -27,3 +43,4 @@ is $(xg -Vrv data/cyclic_path.vg 2>&1 | grep ok | wc -l) 1 "a graph with a path
 
 is $(xg -Vrv data/self_loop_paths.vg 2>&1 | grep ok | wc -l) 1 "a small graph with all self loops validates"
 is $(xg -Vrv data/b.vg 2>&1 | grep ok | wc -l) 1 "a large graph with doubly-reversing edges validates"
+is $(xg -VLrv data/b.vg 2>&1 | grep ok | wc -l) 1 "a graph with nodes ranked in topological order validates"
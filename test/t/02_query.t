@@ -5,7 +5,7 @@ BASH_TAP_ROOT=../bash-tap
 
 PATH=../bin:$PATH # for xg
 
-plan tests 20
+plan tests 41
 
 xg -v data/z.vg -o z.idx 2>/dev/null
 is $(xg -i z.idx -s 10331 | cut -f 2 -d\ ) "CAGCAGTGGAGCAGAAACAGAGGAGATGACACCATGGGGTAAGCACAGTC" "graph can be queried to obtain node labels"
@@ -13,7 +13,11 @@ is $(xg -i z.idx -f 10331 | md5sum | awk '{print $1}') "b7a5dbb50a04c66c3f9e25af
 is $(xg -i z.idx -t 10331 | md5sum | awk '{print $1}') "f7d6410e597fd59eb9ccbc1d7bfe24d1" "graph can be queried to get to nodes"
 is $(xg -i z.idx -n 10331 -c 10 | md5sum | awk '{print $1}') "f5fb8749c0efd962c245377240e50ae5" "graph can be queried to get node context"
 is $(xg -i z.idx -p z:500000-500500 | md5sum | awk '{print $1}') "d476343baeab10feb7afac61e6a2609e" "graph can be queried to get a region of a particular path"
-rm -f z.idx
+is $(printf "node-seq 10331\nquit\n" | xg -i z.idx -Q - | tail -n 1) "CAGCAGTGGAGCAGAAACAGAGGAGATGACACCATGGGGTAAGCACAGTC" "a serving index answers queries from stdin"
+is $(printf "reload z.idx\nnode-seq 10331\n" | xg -i z.idx -Q - | tail -n 1) "CAGCAGTGGAGCAGAAACAGAGGAGATGACACCATGGGGTAAGCACAGTC" "a serving index can be reloaded in place"
+echo "not an index" > bogus.idx
+is "$(printf "reload bogus.idx\nnode-seq 10331\n" | xg -i z.idx -Q - | grep -c '^ERR') $(printf "reload bogus.idx\nnode-seq 10331\n" | xg -i z.idx -Q - | tail -n 1)" "1 CAGCAGTGGAGCAGAAACAGAGGAGATGACACCATGGGGTAAGCACAGTC" "reloading a file that is not an index is refused"
+rm -f z.idx bogus.idx
 
 xg -v data/l.vg -o l.idx 2>/dev/null
 xg -i l.idx -p z:0-100 >/dev/null
@@ -35,6 +39,16 @@ rm c.xg
 xg -v data/xyz.vg -o xyz.idx 2>/dev/null
 (xg -i xyz.idx -p x:10-20 && xg -i xyz.idx -p y:10-20 && xg -i xyz.idx -p z:10-20) >/dev/null
 is $? 0 "a multi-path graph can be queried"
+printf "x\t10\t21\n" > regions.bed
+is $(xg -i xyz.idx -B regions.bed -T | grep -v '^#' | md5sum | cut -f 1 -d\ ) $(xg -i xyz.idx -p x:10-20 -T | md5sum | cut -f 1 -d\ ) "BED regions extract the same subgraph as the equivalent path query"
+printf "x:10-20\ny:10-20\nz:10-20\n" > regions.txt
+is $(xg -i xyz.idx -B regions.txt -j 2 -T | grep -c '^H') 3 "a region list yields one subgraph per region in order"
+printf "x\t10\n" > short.bed
+xg -i xyz.idx -B short.bed 2>/dev/null >/dev/null
+is $? 1 "BED lines without an end are rejected"
+for i in $(seq 1 200); do echo "x:10-20"; done > many.txt
+is $(xg -i xyz.idx -B many.txt -j 1 -T | grep -c '^H') 200 "a long region list finishes on a single thread"
+rm -f regions.bed regions.txt short.bed many.txt
 rm -f xyz.idx
 
 xg -v data/mult.xyz.vg -o mult.xyz.idx 2>/dev/null
@@ -46,6 +60,30 @@ is $? 0 "graphs can be constructed with multiple paths"
 
 xg -v data/ll.vg -o ll.idx 2>/dev/null
 is $(xg -i ll.idx -n 1 -c 10 | md5sum | cut -f 1 -d\ ) $(md5sum data/ll.vg | cut -f 1 -d\ ) "a small graph can be exactly reconstructed from the index"
+is $(xg -i ll.idx -A 1,5) 55 "the path distance between nodes on a path is exact"
+is $(xg -i ll.idx -M 100 -A 1,7) 56 "nodes off a path are placed at their projections onto it"
+printf "1 5\n1 7\n4 4\n" > pairs.txt
+is $(xg -i ll.idx -X pairs.txt | tr '\n' ',') "55,-1,0," "path distances can be found for many pairs at once"
+rm -f pairs.txt
+xg -i ll.idx -C -o llc.idx
+is "$(echo node-positions 4 | xg -i llc.idx -Q - | tail -n 1)" "$(printf 'l\t10')" "node positions in paths can come from the overlay"
+rm -f llc.idx
+is $(xg -i ll.idx -q l:5-14) "GAGAACTGGA" "path sequence can be extracted across node boundaries"
+is $(xg -i ll.idx -q l:0-9 -Z) "CGTGAGAGGA" "path sequence can be extracted from the reverse strand"
+is $(xg -i ll.idx -W | grep -v '^>' | tr -d '\n') $(xg -i ll.idx -q l) "paths can be written out as FASTA"
+is $(xg -i ll.idx -w nope | wc -l) 0 "FASTA output can be limited to paths with a given prefix"
+is "$(xg -i ll.idx -G -g CTCCCA)" "$(printf '1\t-\t3')" "sequences can be found on the reverse strand of nodes"
+is $(xg -i ll.idx -G -g GAT | wc -l) 2 "sequence hits spanning node boundaries are dropped"
+xg -i ll.idx -k 5 -K ll.kmers
+is "$(xg -i ll.idx -K ll.kmers -y AGATC)" "$(printf '1\t+\t6\n4\t-\t52')" "k-mers crossing edges on both strands can be indexed and found"
+xg -i ll.idx -N -o lln.idx
+xg -i lln.idx -k 5 -K lln.kmers
+is "$(xg -i lln.idx -K lln.kmers -y AGATC)" "$(xg -i ll.idx -K ll.kmers -y AGATC)" "graphs walked through packed node records give the same k-mers"
+is $(xg -i lln.idx -n 1 -c 10 | md5sum | cut -f 1 -d\ ) $(md5sum data/ll.vg | cut -f 1 -d\ ) "a graph with packed node records can be exactly reconstructed"
+rm -f ll.kmers lln.kmers lln.idx
+xg -i ll.idx -k 5 -U 3 -m ll.min
+is "$(xg -i ll.idx -m ll.min -e TGGGAGAGAACTGGAACAAG)" "$(printf '2\t1\t+\t2\n5\t1\t+\t5\n7\t1\t+\t7\n9\t2\t+\t0\n9\t4\t-\t36\n11\t4\t+\t1\n13\t4\t+\t3')" "minimizer seeds can be found for a read"
+rm -f ll.min
 rm ll.idx
 
 xg -v data/cyclic_all.vg -o c.idx 2>/dev/null